@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "cipher.h"
+#include "udp_server.h"
+
+
+#define PORT "21893"
+#define MAXLINELEN 256
+#define TIMEOUT_MS 1000  // wait for the results of a batch before sending it again
+#define MAXTRIES 3
+
+const char* result_names[] = { "unknown user", "wrong password", "ok" };
+unsigned long result_counts[3];
+
+// udp_connect returns a UDP socket connected to serverC at host and port, whose
+// receives time out after TIMEOUT_MS, or -1 on failure. The socket setup was
+// taken from Beej's Guide to Network Programming (6.3 Datagram Sockets)
+int udp_connect(const char* host, const char* port)
+{
+    struct addrinfo hints, *servinfo, *p;
+    int rv;
+    int sockfd = -1;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (sockfd == -1) {
+        fprintf(stderr, "audit: cannot reach serverC\n");
+        return -1;
+    }
+    struct timeval tv = { TIMEOUT_MS / 1000, TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    return sockfd;
+}
+
+// check_batch sends the batch authentication request in batch, len bytes with
+// its mark, to serverC and stores the packed results in results, sending it
+// again if they do not come within TIMEOUT_MS. Returns the length of the result
+// vector, or -1 if serverC never answered.
+int check_batch(int sockfd, uint32_t req_id, const char batch[], int len, char results[])
+{
+    char request[UDP_HDR_LEN + UDP_MAXLEN];
+    char response[UDP_HDR_LEN + UDP_MAXLEN];
+    udp_put_req_id(request, req_id);
+    memcpy(request + UDP_HDR_LEN, batch, len);
+    for (int try = 0; try < MAXTRIES; try++) {
+        if (send(sockfd, request, UDP_HDR_LEN + len, 0) == -1) {
+            perror("send");
+            return -1;
+        }
+        ssize_t n;
+        while ((n = recv(sockfd, response, sizeof response, 0)) != -1) {
+            // a late answer to an earlier batch is skipped
+            if (n >= UDP_HDR_LEN && udp_get_req_id(response) == req_id) {
+                memcpy(results, response + UDP_HDR_LEN, n - UDP_HDR_LEN);
+                return n - UDP_HDR_LEN;
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("recv");
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// print_results writes the username of each of the num_pairs pairs of a batch,
+// kept NUL-separated in usernames, next to its result. Returns -1 if the results
+// do not match the batch.
+int print_results(const char usernames[], int num_pairs, const char results[], int len)
+{
+    if (len != (num_pairs + 3) / 4)
+        return -1;
+    for (int i = 0; i < num_pairs; i++) {
+        int result = batch_auth_result(results, i);
+        if (result > 2)
+            return -1;
+        printf("%s\t%s\n", usernames, result_names[result]);
+        result_counts[result]++;
+        usernames += strlen(usernames) + 1;
+    }
+    return 0;
+}
+
+// audit checks "username,password" pairs in bulk against serverC, for audits of
+// many accounts at once: the pairs, one per line of a file ("-" for stdin) with
+// the password unencrypted, are encrypted and sent as batch authentication
+// requests of up to 8 KB, and each username is written with its result:
+//
+//     ./audit cred_unencrypted.txt
+//
+// It exits with status 1 if serverC did not answer a batch.
+int main(int argc, char *argv[])
+{
+    const char* host = "127.0.0.1";
+    const char* port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] file\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-h host] [-p port] file\n", argv[0]);
+        exit(1);
+    }
+    FILE* fp = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r");
+    if (fp == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    int sockfd = udp_connect(host, port);
+    if (sockfd == -1)
+        exit(1);
+
+    char batch[UDP_MAXLEN];  // the request being filled, mark included
+    char usernames[UDP_MAXLEN];  // the usernames of its pairs, NUL-separated
+    char results[UDP_MAXLEN];
+    char line[MAXLINELEN];
+    uint32_t req_id = 1;
+    int len = 0;
+    int names_len = 0;
+    int num_pairs = 0;
+    bool done = false;
+    while (!done) {
+        done = fgets(line, sizeof line, fp) == NULL;
+        int pair_len = 0;
+        if (!done) {
+            // a line too long for the buffer is skipped whole
+            if (strchr(line, '\n') == NULL && !feof(fp)) {
+                int ch;
+                while ((ch = fgetc(fp)) != EOF && ch != '\n')
+                    ;
+                fprintf(stderr, "audit: skipped a line longer than %d bytes\n", MAXLINELEN - 2);
+                continue;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            pair_len = strlen(line);
+            if (pair_len == 0)
+                continue;
+        }
+        // send the batch once it is complete, or the next pair does not fit
+        if (num_pairs > 0 && (done || len + pair_len + 1 >= UDP_MAXLEN)) {
+            int n = check_batch(sockfd, req_id++, batch, len, results);
+            if (n == -1) {
+                fprintf(stderr, "audit: serverC did not answer\n");
+                exit(1);
+            }
+            if (print_results(usernames, num_pairs, results, n) == -1) {
+                fprintf(stderr, "audit: malformed answer from serverC\n");
+                exit(1);
+            }
+            num_pairs = 0;
+        }
+        if (done)
+            break;
+        if (num_pairs == 0) {
+            memcpy(batch, BATCH_AUTH_MARK, BATCH_AUTH_MARK_LEN);
+            len = BATCH_AUTH_MARK_LEN;
+            names_len = 0;
+        }
+        int username_len = strcspn(line, ",");
+        memcpy(usernames + names_len, line, username_len);
+        usernames[names_len + username_len] = '\0';
+        names_len += username_len + 1;
+        encrypt(line, pair_len);
+        memcpy(batch + len, line, pair_len);
+        batch[len + pair_len] = '\n';
+        len += pair_len + 1;
+        num_pairs++;
+    }
+    fprintf(stderr, "%lu ok, %lu wrong password, %lu unknown user\n", result_counts[2], result_counts[1], result_counts[0]);
+    close(sockfd);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+
+// hash_str computes the FNV-1a hash of a NUL-terminated string
+static uint32_t hash_str(const char* str)
+{
+    uint32_t hash = 2166136261u;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// cache_init allocates a cache of at least capacity entries. Returns -1 on failure.
+int cache_init(struct cache* cache, unsigned int capacity, int ttl)
+{
+    memset(cache, 0, sizeof *cache);
+    cache->ttl = ttl;
+    cache->generation = 1;
+    if (ttl <= 0)
+        return 0;
+    cache->num_sets = 1;
+    while (cache->num_sets * CACHE_WAYS < capacity)
+        cache->num_sets *= 2;
+    cache->entries = calloc(cache->num_sets * CACHE_WAYS, sizeof(struct cache_entry));
+    if (cache->entries == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+// is_fresh tells whether entry e may still be served
+static int is_fresh(struct cache* cache, struct cache_entry* e, time_t now)
+{
+    return e->generation == cache->generation && e->expires > now;
+}
+
+// cache_get returns the value stored for key, or NULL if there is none that is
+// still fresh
+const char* cache_get(struct cache* cache, const char key[], time_t now)
+{
+    if (cache->entries == NULL)
+        return NULL;
+    uint32_t hash = hash_str(key);
+    struct cache_entry* set = &cache->entries[(hash & (cache->num_sets - 1)) * CACHE_WAYS];
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        struct cache_entry* e = &set[i];
+        if (e->hash == hash && is_fresh(cache, e, now) && strcmp(e->key, key) == 0) {
+            e->last_used = ++cache->clock;
+            cache->hits++;
+            return e->value;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// cache_put stores value for key, replacing the entry already stored for key or
+// else a stale entry or the least recently used entry of its set. Keys or values
+// too long to store are not cached.
+void cache_put(struct cache* cache, const char key[], const char value[], time_t now)
+{
+    if (cache->entries == NULL || strlen(key) >= CACHE_KEYLEN || strlen(value) >= MAXANSWERLEN)
+        return;
+    uint32_t hash = hash_str(key);
+    struct cache_entry* set = &cache->entries[(hash & (cache->num_sets - 1)) * CACHE_WAYS];
+    struct cache_entry* victim = NULL;
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        struct cache_entry* e = &set[i];
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            victim = e;
+            break;
+        }
+        if (victim == NULL)
+            victim = e;
+        else if (!is_fresh(cache, e, now))
+            victim = is_fresh(cache, victim, now) ? e : victim;
+        else if (is_fresh(cache, victim, now) && e->last_used < victim->last_used)
+            victim = e;
+    }
+    victim->hash = hash;
+    victim->generation = cache->generation;
+    victim->expires = now + cache->ttl;
+    victim->last_used = ++cache->clock;
+    strcpy(victim->key, key);
+    strcpy(victim->value, value);
+}
+
+// cache_invalidate makes every stored entry stale at once
+void cache_invalidate(struct cache* cache)
+{
+    cache->generation++;
+}
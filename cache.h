@@ -0,0 +1,40 @@
+// cache.h declares the result cache serverM keeps for course queries
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "protocol.h"
+
+#define CACHE_WAYS 4  // entries per set; the least recently used one is evicted
+#define CACHE_KEYLEN 100  // longest key, NUL included
+
+// cache_entry holds one key and its value
+struct cache_entry {
+    uint32_t hash;
+    unsigned int generation;  // entries from before the last invalidation are stale
+    time_t expires;
+    unsigned long last_used;
+    char key[CACHE_KEYLEN];
+    char value[MAXANSWERLEN];
+};
+
+// cache is a bounded set-associative map from strings to strings whose entries
+// expire ttl seconds after they were stored
+struct cache {
+    struct cache_entry* entries;  // num_sets * CACHE_WAYS entries
+    unsigned int num_sets;  // a power of two
+    int ttl;  // seconds; 0 disables the cache
+    unsigned int generation;  // starts at 1, so zeroed entries are stale
+    unsigned long clock;  // bumped on every access, for LRU
+    unsigned long hits;
+    unsigned long misses;
+};
+
+int cache_init(struct cache* cache, unsigned int capacity, int ttl);
+const char* cache_get(struct cache* cache, const char key[], time_t now);
+void cache_put(struct cache* cache, const char key[], const char value[], time_t now);
+void cache_invalidate(struct cache* cache);
+
+#endif
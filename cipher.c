@@ -0,0 +1,127 @@
+#include <stdint.h>
+
+#include "cipher.h"
+
+#ifdef __x86_64__  // SSE2 is only guaranteed on x86-64
+#include <immintrin.h>
+#define CIPHER_X86
+#endif
+
+
+// shifts holds how far letters and digits move forward within their range;
+// decrypting moves them forward by the rest of the range
+struct shifts {
+    uint8_t letter;
+    uint8_t digit;
+};
+
+static const struct shifts encrypt_shifts = {CIPHER_SHIFT, CIPHER_SHIFT};
+static const struct shifts decrypt_shifts = {26 - CIPHER_SHIFT, 10 - CIPHER_SHIFT};
+
+// shift_char shifts one character, if it is a letter or a digit
+static char shift_char(char ch, const struct shifts* s)
+{
+    uint8_t c = ch;
+    if ((uint8_t)(c - 'A') < 26)
+        return 'A' + (c - 'A' + s->letter) % 26;
+    if ((uint8_t)(c - 'a') < 26)
+        return 'a' + (c - 'a' + s->letter) % 26;
+    if ((uint8_t)(c - '0') < 10)
+        return '0' + (c - '0' + s->digit) % 10;
+    return ch;
+}
+
+// shift_scalar shifts len characters one at a time
+static void shift_scalar(char str[], size_t len, const struct shifts* s)
+{
+    for (size_t i = 0; i < len; i++)
+        str[i] = shift_char(str[i], s);
+}
+
+#ifdef CIPHER_X86
+// shift_range_sse2 shifts the bytes of x within [lo, lo + n) by shift, without
+// branching: a byte is in range if x - lo is below n (unsigned), and wraps
+// around if x - lo + shift is not
+static __m128i shift_range_sse2(__m128i x, uint8_t lo, uint8_t n, uint8_t shift)
+{
+    __m128i off = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(off, _mm_set1_epi8(n - 1)), off);
+    __m128i moved = _mm_add_epi8(off, _mm_set1_epi8(shift));
+    __m128i wraps = _mm_cmpeq_epi8(_mm_max_epu8(moved, _mm_set1_epi8(n)), moved);
+    moved = _mm_sub_epi8(moved, _mm_and_si128(wraps, _mm_set1_epi8(n)));
+    moved = _mm_add_epi8(moved, _mm_set1_epi8(lo));
+    return _mm_or_si128(_mm_and_si128(in_range, moved), _mm_andnot_si128(in_range, x));
+}
+
+// shift_sse2 shifts 16 characters at a time; SSE2 is part of every x86-64 CPU
+static void shift_sse2(char str[], size_t len, const struct shifts* s)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(str + i));
+        x = shift_range_sse2(x, 'A', 26, s->letter);
+        x = shift_range_sse2(x, 'a', 26, s->letter);
+        x = shift_range_sse2(x, '0', 10, s->digit);
+        _mm_storeu_si128((__m128i*)(str + i), x);
+    }
+    shift_scalar(str + i, len - i, s);
+}
+
+// shift_range_avx2 is shift_range_sse2 on 32 bytes
+__attribute__((target("avx2")))
+static __m256i shift_range_avx2(__m256i x, uint8_t lo, uint8_t n, uint8_t shift)
+{
+    __m256i off = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    __m256i in_range = _mm256_cmpeq_epi8(_mm256_min_epu8(off, _mm256_set1_epi8(n - 1)), off);
+    __m256i moved = _mm256_add_epi8(off, _mm256_set1_epi8(shift));
+    __m256i wraps = _mm256_cmpeq_epi8(_mm256_max_epu8(moved, _mm256_set1_epi8(n)), moved);
+    moved = _mm256_sub_epi8(moved, _mm256_and_si256(wraps, _mm256_set1_epi8(n)));
+    moved = _mm256_add_epi8(moved, _mm256_set1_epi8(lo));
+    return _mm256_blendv_epi8(x, moved, in_range);
+}
+
+// shift_avx2 shifts 32 characters at a time, on CPUs that have AVX2
+__attribute__((target("avx2")))
+static void shift_avx2(char str[], size_t len, const struct shifts* s)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(str + i));
+        x = shift_range_avx2(x, 'A', 26, s->letter);
+        x = shift_range_avx2(x, 'a', 26, s->letter);
+        x = shift_range_avx2(x, '0', 10, s->digit);
+        _mm256_storeu_si256((__m256i*)(str + i), x);
+    }
+    shift_sse2(str + i, len - i, s);
+}
+#endif
+
+typedef void (*shift_fn)(char str[], size_t len, const struct shifts* s);
+
+static shift_fn shift_impl;
+
+// pick_impl chooses the widest implementation the CPU running us supports
+static shift_fn pick_impl(void)
+{
+    if (shift_impl == NULL) {
+#ifdef CIPHER_X86
+        __builtin_cpu_init();
+        shift_impl = __builtin_cpu_supports("avx2") ? shift_avx2 : shift_sse2;
+#else
+        shift_impl = shift_scalar;
+#endif
+    }
+    return shift_impl;
+}
+
+// encrypt encrypts the first len characters of str in place
+void encrypt(char str[], size_t len)
+{
+    pick_impl()(str, len, &encrypt_shifts);
+}
+
+// decrypt undoes encrypt
+void decrypt(char str[], size_t len)
+{
+    pick_impl()(str, len, &decrypt_shifts);
+}
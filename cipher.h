@@ -0,0 +1,13 @@
+// cipher.h declares the credential cipher: letters and digits are shifted by 4
+// within their own range ('Z' -> 'D', '9' -> '3'), everything else is kept
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <stddef.h>
+
+#define CIPHER_SHIFT 4
+
+void encrypt(char str[], size_t len);
+void decrypt(char str[], size_t len);
+
+#endif
@@ -9,10 +9,22 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+
+#include "protocol.h"
+#include "mclient.h"
 
 
 #define PORT "25893"
 #define MAXBUFLEN 100
+#define MAXFRAMELEN (FRAME_HDR_LEN + MAXRESPONSELEN)  // longest message on the connection
+
+
+char in_buf[2 * MAXFRAMELEN];  // bytes received from serverM not yet returned as messages
+int in_len;
+uint32_t next_tag = 1;  // tag of the next request sent to serverM
+char* token_file;  // where the session token is kept, if "-s" was given
+int batch_errors;  // queries of a batch run that were too long or got no answer
 
 
 // get_in_addr function was taken from Beej's Guide to Network Programming
@@ -78,43 +90,349 @@ int tcp_connect(char dyn_port[])
     return sockfd;
 }
 
-// recv_str receives string messages from serverM and stores it in buf
-void recv_str(int sockfd, char buf[])
+// save_token stores the session token serverM issued after a login, readable only
+// by the user, so the next run of the client can resume the session
+void save_token(char token[])
+{
+    FILE* fp;
+    int fd = open(token_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+        perror(token_file);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    fprintf(fp, "%s\n", token);
+    fclose(fp);
+}
+
+// recv_msg receives the next message from serverM and stores its string in buf,
+// which holds MAXRESPONSELEN + 1 bytes, and its tag in tag. Bytes received beyond
+// that message are kept for the next call. A session token is saved, if the
+// client keeps one, and skipped. Returns the message type.
+int recv_msg(int sockfd, uint32_t* tag, char buf[])
 {
     int numbytes;
-    if ((numbytes = recv(sockfd, buf, MAXBUFLEN-1, 0)) == -1) {
-        perror("recv");
+    uint8_t type;
+    uint32_t len;
+    int frame_len;
+    while ((frame_len = frame_parse(in_buf, in_len, MAXRESPONSELEN, &type, tag, &len)) == 0) {
+        if ((numbytes = recv(sockfd, in_buf + in_len, sizeof in_buf - in_len, 0)) == -1) {
+            perror("recv");
+            exit(1);
+        }
+        if (numbytes == 0) {
+            fprintf(stderr, "client: connection closed by the main server\n");
+            exit(1);
+        }
+        in_len += numbytes;
+    }
+    if (frame_len == -1) {
+        fprintf(stderr, "client: malformed message from the main server\n");
         exit(1);
     }
-    buf[numbytes] = '\0';
+    memcpy(buf, in_buf + FRAME_HDR_LEN, len);
+    buf[len] = '\0';
+    memmove(in_buf, in_buf + frame_len, in_len - frame_len);
+    in_len -= frame_len;
+    if (type == MSG_SESSION) {
+        if (token_file != NULL)
+            save_token(buf);
+        return recv_msg(sockfd, tag, buf);
+    }
+    return type;
 }
 
-// send_str sends string messages, stored in str, to serverM
-int send_str(int sockfd, char str[])
+// send_msg sends a message of the given type carrying string str to serverM,
+// tagged with tag
+void send_msg(int sockfd, uint8_t type, uint32_t tag, char str[])
 {
-    if (send(sockfd, str, strlen(str), 0) == -1)
-        perror("send");
+    char frame[MAXFRAMELEN];
+    int len = strlen(str);
+    int sent = 0;
+    int numbytes;
+    frame_put_header(frame, type, tag, len);
+    memcpy(frame + FRAME_HDR_LEN, str, len);
+    while (sent < FRAME_HDR_LEN + len) {
+        if ((numbytes = send(sockfd, frame + sent, FRAME_HDR_LEN + len - sent, 0)) == -1) {
+            perror("send");
+            return;
+        }
+        sent += numbytes;
+    }
+}
+
+// query_loop continuously asks for course queries once the client is logged in,
+// up until the client is manually terminated by the user
+void query_loop(int sockfd, char username[], char dyn_port[])
+{
+    char category[MAXBUFLEN];
+    char course[MAXQUERYLEN]; // one course code, or several separated by ','
+    char* courses[MAXBATCH]; // the individual course codes of a batch query
+    char course_category[MAXQUERYLEN]; // store concatenated course code and query category pairs
+    char buf_response[MAXRESPONSELEN + 1]; // stores any response from serverM
+    uint32_t tag; // tag of the response; one request is outstanding at a time, so it is not needed
+
+    while (1) {
+        printf("Please enter the course code to query:");
+        scanf("%s", course);
+        course[strcspn(course, "\t\r\n\v\f")] = 0;
+        printf("Please enter the category (Credit / Professor / Days / CourseName, several joined by \"+\", or All):");
+        scanf("%s", category);
+        category[strcspn(category, "\t\r\n\v\f")] = 0;
+
+        // several course codes separated by ',' are looked up with a single
+        // batch request of course-category pairs separated by ';'
+        int num_courses = 0;
+        for (char* code = strtok(course, ","); code != NULL && num_courses < MAXBATCH; code = strtok(NULL, ","))
+            courses[num_courses++] = code;
+        if (num_courses == MAXBATCH && strtok(NULL, ",") != NULL)
+            printf("Only the first %d course codes are looked up.\n", MAXBATCH);
+        if (num_courses == 0)
+            courses[num_courses++] = course;
+        course_category[0] = '\0';
+        for (int i = 0; i < num_courses; i++) {
+            if (i > 0)
+                strcat(course_category, ";");
+            strcat(course_category, courses[i]);
+            strcat(course_category, ",");
+            strcat(course_category, category);
+        }
+
+        // send course query request to serverM as concatenated course-category string
+        send_msg(sockfd, MSG_QUERY, next_tag++, course_category);
+        printf("%s sent a request to the main server.\n", username);
+        recv_msg(sockfd, &tag, buf_response);
+        printf("The client received the response from the Main server using TCP over port %s.\n", dyn_port);
+        // the response holds one answer per course code, one per line
+        char* answer = buf_response;
+        for (int i = 0; i < num_courses; i++) {
+            char* next = strchr(answer, '\n');
+            if (next != NULL)
+                *next++ = '\0';
+            if (strcmp(answer, "None") == 0) {
+                printf("Didn't find the course: %s.\n", courses[i]);
+            }
+            else if (strcmp(answer, "NoneCategory") == 0) {
+                printf("Didn't find the category: %s.\n", category);
+            }
+            else if (strcmp(answer, "Unavailable") == 0) {
+                printf("The department server for %s did not respond.\n", courses[i]);
+            }
+            else if (strcmp(answer, TOO_LONG_QUERY) == 0) {
+                printf("The query about %s is too long.\n", courses[i]);
+            }
+            else {
+                printf("The %s of %s is %s.\n", category, courses[i], answer);
+            }
+            answer = next != NULL ? next : "";
+        }
+        printf("\n-----Start a new request-----\n");
+    }
+}
+
+// resume_session sends the saved session token in place of a login. Returns 1,
+// with the username the token was issued for, if serverM accepted it.
+int resume_session(int sockfd, char username[])
+{
+    char token[MAXBUFLEN * 2];
+    char buf_response[MAXRESPONSELEN + 1];
+    uint32_t tag;
+    FILE* fp = fopen(token_file, "r");
+    if (fp == NULL)
+        return 0;
+    if (fgets(token, sizeof token, fp) == NULL) {
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+    token[strcspn(token, "\t\r\n\v\f")] = 0;
+
+    send_msg(sockfd, MSG_RESUME, next_tag++, token);
+    recv_msg(sockfd, &tag, buf_response);
+    if (strcmp(buf_response, "2") != 0)
+        return 0;
+    // the token reads "username:expiry:mac"
+    *strrchr(token, ':') = '\0';
+    *strrchr(token, ':') = '\0';
+    strcpy(username, token);
+    return 1;
+}
+
+// batch_request is one request of a batch run: up to MAXBATCH queries sent
+// together, as a batch query
+struct batch_request {
+    int num_queries;
+    int len;
+    char queries[MAXQUERYLEN];  // "course,category" pairs separated by ';'
+};
+
+// print_answers writes each query of a batch request next to its answer, and
+// frees the request. Queries that got no answer, or "Unavailable", count as
+// errors.
+void print_answers(void* arg, int status, const char* answer)
+{
+    struct batch_request* r = arg;
+    char* save;
+    const char* rest = answer;
+    for (char* query = strtok_r(r->queries, ";", &save); query != NULL; query = strtok_r(NULL, ";", &save)) {
+        if (status != MCLIENT_OK) {
+            printf("%s\tError\n", query);
+            batch_errors++;
+            continue;
+        }
+        int len = strcspn(rest, "\n");
+        printf("%s\t%.*s\n", query, len, rest);
+        if (len == strlen("Unavailable") && strncmp(rest, "Unavailable", len) == 0)
+            batch_errors++;
+        rest += rest[len] == '\n' ? len + 1 : len;
+    }
+    free(r);
+}
+
+// send_batch_request sends r over the pool, waiting for answers to make room if
+// as many queries as serverM allows are outstanding
+void send_batch_request(struct mclient* mc, struct batch_request* r)
+{
+    int rv;
+    while ((rv = mclient_query(mc, r->queries, print_answers, r)) == MCLIENT_BUSY)
+        mclient_poll(mc, -1);
+    if (rv != MCLIENT_OK)
+        print_answers(r, rv, NULL);
+    // print whatever answers have already come in
+    mclient_poll(mc, 0);
+}
+
+// run_batch logs in with the "username,password" on the first line of fp and
+// looks up the "course,category" query on each further line, writing every query
+// with its answer, separated by a tab, in the order the answers arrive. Queries
+// are packed MAXBATCH to a request and streamed over num_conns connections with
+// as many requests outstanding as serverM allows. Returns the exit status: 1 if
+// any query was too long or got no answer, or "Unavailable", 0 otherwise.
+int run_batch(FILE* fp, int num_conns)
+{
+    char line[MAXQUERYLEN];
+    struct mclient mc;
+    if (fgets(line, sizeof line, fp) == NULL) {
+        fprintf(stderr, "batch: no username,password line\n");
+        return 1;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    char* password = strchr(line, ',');
+    if (password == NULL) {
+        fprintf(stderr, "batch: the first line must be username,password\n");
+        return 1;
+    }
+    *password++ = '\0';
+    int rv = mclient_open(&mc, NULL, NULL, line, password, num_conns);
+    if (rv != MCLIENT_OK) {
+        fprintf(stderr, "batch: %s\n", rv == MCLIENT_DENIED ? "login refused" : "cannot connect to the main server");
+        return 1;
+    }
+
+    struct batch_request* r = NULL;
+    while (fgets(line, sizeof line, fp) != NULL) {
+        char* save;
+        // a line too long for the buffer is skipped whole
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            int ch;
+            while ((ch = fgetc(fp)) != EOF && ch != '\n')
+                ;
+            printf("%s...\t%s\n", line, TOO_LONG_QUERY);
+            batch_errors++;
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        // a line may itself hold several queries separated by ';'
+        for (char* query = strtok_r(line, ";", &save); query != NULL; query = strtok_r(NULL, ";", &save)) {
+            int len = strlen(query);
+            if (len == 0)
+                continue;
+            if (len >= MAXPAIRLEN) {
+                printf("%s\t%s\n", query, TOO_LONG_QUERY);
+                batch_errors++;
+                continue;
+            }
+            if (r == NULL && (r = calloc(1, sizeof(struct batch_request))) == NULL) {
+                perror("calloc");
+                return 1;
+            }
+            if (r->num_queries > 0)
+                r->queries[r->len++] = ';';
+            memcpy(r->queries + r->len, query, len + 1);
+            r->len += len;
+            if (++r->num_queries == MAXBATCH) {
+                send_batch_request(&mc, r);
+                r = NULL;
+            }
+        }
+    }
+    if (r != NULL)
+        send_batch_request(&mc, r);
+    while (mclient_outstanding(&mc) > 0) {
+        if (mclient_poll(&mc, -1) == -1) {
+            perror("epoll_wait");
+            return 1;
+        }
+    }
+    mclient_close(&mc);
+    return batch_errors > 0 ? 1 : 0;
 }
 
 // The main client loop first prompts user for login information,
 // allowing up to 3 attempts to login. If unsuccessful, the client exits.
 // If login was successful, it continuously asks for course queries
-// up until the client is manually terminated by the user.
+// up until the client is manually terminated by the user. Started with
+// "-s file", the client keeps the session token from a login in file and
+// resumes that session on its next run without asking for the password. Started
+// with "-b file" ("-" for stdin), it runs the login and queries in file instead,
+// without prompting; "-c N" spreads them over N connections.
 int main(int argc, char *argv[])
 {
-    int numbytes;
     char username[MAXBUFLEN];
     char password[MAXBUFLEN];
     char username_password[MAXBUFLEN]; // store concatenated username and password
-    char category[MAXBUFLEN];
-    char course[MAXBUFLEN];
-    char course_category[MAXBUFLEN]; // store concatenated course code and query category
-    char buf_response[MAXBUFLEN]; // stores any response from serverM
+    char buf_response[MAXRESPONSELEN + 1]; // stores any response from serverM
+    uint32_t tag; // tag of the response; one request is outstanding at a time, so it is not needed
     char dyn_port[INET6_ADDRSTRLEN]; // stores client-side dynamically assigned TCP port number
+    int opt;
+    char* batch_file = NULL;
+    int num_conns = 1;
+
+    while ((opt = getopt(argc, argv, "s:b:c:")) != -1) {
+        if (opt == 's')
+            token_file = optarg;
+        else if (opt == 'b')
+            batch_file = optarg;
+        else if (opt == 'c')
+            num_conns = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-s session_token_file] [-b batch_file [-c connections]]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (batch_file != NULL) {
+        FILE* fp = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+        if (fp == NULL) {
+            perror(batch_file);
+            exit(1);
+        }
+        if (num_conns < 1 || num_conns > MCLIENT_MAXCONNS) {
+            fprintf(stderr, "%s: connections must be between 1 and %d\n", argv[0], MCLIENT_MAXCONNS);
+            exit(1);
+        }
+        return run_batch(fp, num_conns);
+    }
     int sockfd = tcp_connect(dyn_port); // TCP socket descriptor
 
     printf("The client is up and running.\n");
 
+    // a session token kept from an earlier login skips the password prompts
+    if (token_file != NULL && resume_session(sockfd, username)) {
+        printf("%s resumed the session using TCP over port %s.\n", username, dyn_port);
+        query_loop(sockfd, username, dyn_port);
+    }
+
     int remaining_attempts = 3;
 
     while (remaining_attempts > 0) {
@@ -130,47 +448,27 @@ int main(int argc, char *argv[])
         strcat(username_password, password);
 
         // send login request to serverM as concatenated username-password string
-        send_str(sockfd, username_password);
+        send_msg(sockfd, MSG_LOGIN, next_tag++, username_password);
         printf("%s sent an authentication request to the main server.\n", username);
         // receive login response into buf_response
-        recv_str(sockfd, buf_response);
+        recv_msg(sockfd, &tag, buf_response);
     
         // a response of 2 to the login request represents a SUCCESSFUL login.
         // Subsequently enters a loop of requesting for course-category queries.
         if (strcmp(buf_response, "2") == 0) {
             printf("%s received the result of authentication using TCP over port %s. Authentication is successful\n", username, dyn_port);
-            while (1) {
-                printf("Please enter the course code to query:");
-                scanf("%s", course);
-                course[strcspn(course, "\t\r\n\v\f")] = 0;
-                strcpy(course_category, course);
-                printf("Please enter the category (Credit / Professor / Days / CourseName):");
-                scanf("%s", category);
-                category[strcspn(category, "\t\r\n\v\f")] = 0;
-                strcat(course_category, ",");
-                strcat(course_category, category);
-
-                // send course query request to serverM as concatenated course-category string
-                send_str(sockfd, course_category);
-                printf("%s sent a request to the main server.\n", username);
-                recv_str(sockfd, buf_response);
-                printf("The client received the response from the Main server using TCP over port %s.\n", dyn_port);
-                if (strcmp(buf_response, "None") == 0) {
-                    printf("Didn't find the course: %s.\n", course);
-                }
-                else if (strcmp(buf_response, "NoneCategory") == 0) {
-                    printf("Didn't find the category: %s.\n", category);
-                }
-                else {
-                    printf("The %s of %s is %s.\n", category, course, buf_response);
-                }
-                printf("\n-----Start a new request-----\n");
-            }
+            query_loop(sockfd, username, dyn_port);
         }
         // Login attempt response of 1 represents INCORRECT PASSWORD case
         else if (strcmp(buf_response, "1") == 0) {
             printf("%s received the result of authentication using TCP over port %s. Authentication failed: Password does not match\n", username, dyn_port);
         }
+        // Login attempt response of Unavailable means serverC did not respond; the
+        // attempt does not count
+        else if (strcmp(buf_response, "Unavailable") == 0) {
+            printf("%s received the result of authentication using TCP over port %s. Authentication failed: The credentials server did not respond\n", username, dyn_port);
+            remaining_attempts++;
+        }
         // Login attempt response of anything else represents INCORRECT USERNAME case
         else {
             printf("%s received the result of authentication using TCP over port %s. Authentication failed: Username Does not exist\n", username, dyn_port);
@@ -0,0 +1,83 @@
+#include <string.h>
+
+#include "protocol.h"
+#include "course.h"
+
+
+// category_field resolves a category name to the field holding it, or returns -1
+// if there is no such category
+static int category_field(struct str_view category)
+{
+    if (view_equals(category, view_of("Credit")))
+        return FIELD_CREDIT;
+    if (view_equals(category, view_of("Professor")))
+        return FIELD_PROFESSOR;
+    if (view_equals(category, view_of("Days")))
+        return FIELD_DAYS;
+    if (view_equals(category, view_of("CourseName")))
+        return FIELD_NAME;
+    return -1;
+}
+
+// category_mask resolves a category, or several joined by CATEGORY_SEP, to a
+// bitmask with one bit per field holding them; CATEGORY_ALL selects every field
+// but the course code. Returns 0 if any of the categories does not exist.
+unsigned int category_mask(const char* category)
+{
+    if (strcmp(category, CATEGORY_ALL) == 0)
+        return ((1u << NUM_FIELDS) - 1) & ~(1u << FIELD_CODE);
+    unsigned int mask = 0;
+    struct str_view rest = view_of(category);
+    struct str_view name;
+    while (next_token(&rest, CATEGORY_SEP, &name)) {
+        int field = category_field(name);
+        if (field == -1)
+            return 0;
+        mask |= 1u << field;
+    }
+    return mask;
+}
+
+// append_view copies value to the end of the len bytes in buf, which holds
+// MAXANSWERLEN bytes, cutting it short if it does not fit
+static void append_view(char buf[], int* len, struct str_view value)
+{
+    int n = value.len < MAXANSWERLEN - 1 - *len ? (int)value.len : MAXANSWERLEN - 1 - *len;
+    memcpy(buf + *len, value.ptr, n);
+    *len += n;
+}
+
+// select_fields returns the fields of a row picked by mask, in file order and
+// separated by ','. Fields that already follow one another in the table with a
+// single ',' between them, as a whole row does in a snapshot and usually in the
+// text file, are returned as one view of the table, so a whole record is sent
+// without being copied; otherwise the fields are copied into buf, which holds
+// MAXANSWERLEN bytes.
+struct str_view select_fields(const struct table* t, uint32_t row, unsigned int mask, char buf[])
+{
+    struct str_view value = { NULL, 0 };
+    int len = 0;  // bytes of buf in use, once the fields are being copied
+    for (int f = 0; f < NUM_FIELDS; f++) {
+        if (!(mask & (1u << f)))
+            continue;
+        struct str_view field = table_field(t, row, f);
+        if (value.ptr == NULL) {
+            value = field;
+            continue;
+        }
+        if (value.ptr != buf && field.ptr == value.ptr + value.len + 1 && value.ptr[value.len] == ',') {
+            value.len += 1 + field.len;
+            continue;
+        }
+        if (value.ptr != buf) {
+            append_view(buf, &len, value);
+            value.ptr = buf;
+        }
+        append_view(buf, &len, view_of(","));
+        append_view(buf, &len, field);
+        value.len = len;
+    }
+    if (value.ptr != buf && value.len > MAXANSWERLEN - 1)
+        value.len = MAXANSWERLEN - 1;
+    return value;
+}
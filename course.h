@@ -0,0 +1,21 @@
+// course.h declares the layout of the course tables of serverCS/serverEE and
+// picks the fields of a row a course query asks for
+#ifndef COURSE_H
+#define COURSE_H
+
+#include "table.h"
+
+// fields of a course line, in file order
+enum course_field {
+    FIELD_CODE,
+    FIELD_CREDIT,
+    FIELD_PROFESSOR,
+    FIELD_DAYS,
+    FIELD_NAME,
+    NUM_FIELDS
+};
+
+unsigned int category_mask(const char* category);
+struct str_view select_fields(const struct table* t, uint32_t row, unsigned int mask, char buf[]);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "datafile.h"
+
+
+// view_of returns a view of a NUL-terminated string
+struct str_view view_of(const char* str)
+{
+    struct str_view view = { str, strlen(str) };
+    return view;
+}
+
+// view_equals compares two views byte by byte
+int view_equals(struct str_view view, struct str_view other)
+{
+    return view.len == other.len && memcmp(view.ptr, other.ptr, view.len) == 0;
+}
+
+// hash_view computes the FNV-1a hash of a view
+uint32_t hash_view(struct str_view view)
+{
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < view.len; i++) {
+        hash ^= (unsigned char)view.ptr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// map_data_file maps the whole file at path read-only into memory. The tables
+// built on the mapping hold views into it, so it stays mapped for as long as
+// they do. Returns -1 on failure.
+int map_data_file(const char* path, struct str_view* data)
+{
+    int fd;
+    struct stat st;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+    data->len = st.st_size;
+    data->ptr = "";
+    // mmap() refuses empty mappings; an empty file is simply an empty view
+    if (data->len > 0) {
+        void* addr = mmap(NULL, data->len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        data->ptr = addr;
+    }
+    close(fd);
+    return 0;
+}
+
+// unmap_data_file releases a mapping made by map_data_file
+void unmap_data_file(struct str_view data)
+{
+    if (data.len > 0)
+        munmap((void*)data.ptr, data.len);
+}
+
+// next_token splits rest at the first delim: token gets the part before it and
+// rest the part after it, or token gets all of rest if there is no delim.
+// Returns 0 once rest is used up.
+int next_token(struct str_view* rest, char delim, struct str_view* token)
+{
+    if (rest->ptr == NULL)
+        return 0;
+    const char* end = memchr(rest->ptr, delim, rest->len);
+    token->ptr = rest->ptr;
+    if (end == NULL) {
+        token->len = rest->len;
+        rest->ptr = NULL;
+        rest->len = 0;
+    }
+    else {
+        token->len = end - rest->ptr;
+        rest->len -= token->len + 1;
+        rest->ptr = end + 1;
+    }
+    return 1;
+}
+
+// trim_view cuts a view at its first control whitespace character, such as the
+// '\r' of a line ending in "\r\n"
+struct str_view trim_view(struct str_view view)
+{
+    for (uint32_t i = 0; i < view.len; i++) {
+        // '\t', '\n', '\v', '\f' and '\r' are consecutive in ASCII
+        if (view.ptr[i] >= '\t' && view.ptr[i] <= '\r') {
+            view.len = i;
+            break;
+        }
+    }
+    return view;
+}
@@ -0,0 +1,23 @@
+// datafile.h declares the read-only mapping of the data files of the servers
+// C/CS/EE, and the string views they index the mapping with
+#ifndef DATAFILE_H
+#define DATAFILE_H
+
+#include <stdint.h>
+
+// str_view is a string that is not NUL-terminated, usually a field inside a
+// mapped data file
+struct str_view {
+    const char* ptr;
+    uint32_t len;
+};
+
+struct str_view view_of(const char* str);
+int view_equals(struct str_view view, struct str_view other);
+uint32_t hash_view(struct str_view view);
+int map_data_file(const char* path, struct str_view* data);
+void unmap_data_file(struct str_view data);
+int next_token(struct str_view* rest, char delim, struct str_view* token);
+struct str_view trim_view(struct str_view view);
+
+#endif
@@ -0,0 +1,55 @@
+#include "hist.h"
+
+
+// hist_bucket returns the bucket counting value
+int hist_bucket(uint64_t value)
+{
+    if (value >= (1ull << 32))
+        value = (1ull << 32) - 1;
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+    int exp = 63 - __builtin_clzll(value);  // value is in [2^exp, 2^(exp+1))
+    int shift = exp - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (value >> shift) - HIST_SUB_BUCKETS;
+}
+
+// hist_bucket_max returns the largest value counted by bucket
+static uint64_t hist_bucket_max(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(bucket % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS) << shift;
+    return base + (1ull << shift) - 1;
+}
+
+// hist_record counts one value
+void hist_record(struct hist* h, uint64_t value)
+{
+    h->counts[hist_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+// hist_percentile returns a value that percentile percent of the recorded
+// values do not exceed, rounded up to the end of its bucket but never above the
+// largest value recorded; 0 if nothing was recorded
+uint64_t hist_percentile(const struct hist* h, double percentile)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(percentile / 100 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_bucket_max(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
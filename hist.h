@@ -0,0 +1,27 @@
+// hist.h declares the latency histogram serverM keeps for each backend, also
+// used by the stage metrics of every server and by loadgen
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+// Values are counted in log-linear buckets: exact below HIST_SUB_BUCKETS, and
+// above that HIST_SUB_BUCKETS buckets per power of two, so every bucket is within
+// 1/HIST_SUB_BUCKETS (about 6%) of the values it holds, up to 2^32.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+// hist counts recorded values, e.g. latencies in microseconds
+struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+int hist_bucket(uint64_t value);
+void hist_record(struct hist* h, uint64_t value);
+uint64_t hist_percentile(const struct hist* h, double percentile);
+
+#endif
@@ -0,0 +1,445 @@
+#define _GNU_SOURCE  // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "hist.h"
+
+
+#define PORT "25893"
+#define MAXFRAMELEN (FRAME_HDR_LEN + MAXQUERYLEN)  // longest query request on the connection
+#define MAXINLEN (FRAME_HDR_LEN + MAXRESPONSELEN)  // longest message from serverM
+#define OUT_BUFLEN (4 * MAXFRAMELEN)  // queries wait for room once this much output is unsent
+#define MAXEVENTS 256
+#define MAXCREDS 4096
+#define MAXCOURSES 4096
+
+
+// the stages of a simulated client's session whose latency is measured
+enum stage {
+    STAGE_CONNECT,  // connect() until the connection is established
+    STAGE_LOGIN,  // login request until its result, for the successful login
+    STAGE_QUERY,  // query of a single course until its answer
+    STAGE_BATCH,  // query of several courses until the answer to all of them
+    NUM_STAGES
+};
+
+const char* stage_names[NUM_STAGES] = { "connect", "login", "query", "batch" };
+
+enum sim_state {
+    SIM_CONNECTING,
+    SIM_LOGGING_IN,
+    SIM_QUERYING,
+    SIM_DONE
+};
+
+// sim is one simulated client: it connects, logs in, possibly after a wrong
+// password first, then sends its queries keeping up to depth of them outstanding
+struct sim {
+    int fd;
+    enum sim_state state;
+    int cred;  // index into creds of the user it logs in as
+    bool wrong_password;  // its first login attempt uses a wrong password
+    int queries_left;  // queries not sent yet
+    int inflight;
+    uint64_t started_us;  // when the connect or login being measured began
+    uint64_t sent_us[MAXINFLIGHT];  // when the query in each slot was sent
+    bool slot_batch[MAXINFLIGHT];  // whether the query in each slot is a batch
+    uint32_t free_slots;  // bit i is set if slot i is free
+    uint32_t next_seq;
+    char in[2 * MAXINLEN];
+    int in_len;
+    char out[OUT_BUFLEN];
+    int out_len;
+};
+
+// credentials and course codes queries are drawn from
+char* usernames[MAXCREDS];
+char* passwords[MAXCREDS];
+int num_creds;
+char* courses[MAXCOURSES];
+int num_courses;
+// one category, several at once, or the whole record
+const char* categories[] = { "Credit", "Professor", "Days", "CourseName", "Credit+Days", "Professor+CourseName", CATEGORY_ALL };
+#define NUM_CATEGORIES (int)(sizeof categories / sizeof categories[0])
+
+// options
+const char* host = "127.0.0.1";
+const char* port = PORT;
+int num_sims = 1000;
+int queries_per_sim = 100;
+int depth = 1;
+int batch_percent = 10;  // of queries that ask for several courses at once
+int max_batch = 5;
+int wrong_password_percent = 10;  // of clients that first try a wrong password
+int time_limit = 60;  // seconds
+
+struct sim* sims;
+int epfd;
+struct hist stage_hists[NUM_STAGES];
+unsigned long sims_done;
+unsigned long login_errors;  // logins answered with anything but the expected result
+unsigned long unavailable;  // answers saying a server did not respond
+unsigned long conn_errors;  // connections that failed or closed early
+
+
+// now_us returns the monotonic time in microseconds
+uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// read_lines reads the first field of every line of path, or both fields split
+// at the first ',' if second is not NULL, skipping a username seen before since
+// serverC only ever matches the first one. Returns the number of lines read.
+int read_lines(const char* path, char* first[], char* second[], int max)
+{
+    char line[MAXPAIRLEN * 4];
+    int n = 0;
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (n < max && fgets(line, sizeof line, fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* comma = strchr(line, ',');
+        if (comma == NULL)
+            continue;
+        *comma = '\0';
+        bool seen = false;
+        for (int i = 0; second != NULL && i < n && !seen; i++)
+            seen = strcmp(first[i], line) == 0;
+        if (seen)
+            continue;
+        first[n] = strdup(line);
+        if (second != NULL)
+            second[n] = strdup(comma + 1);
+        n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+// queue_msg appends a framed message to the output of s
+void queue_msg(struct sim* s, uint8_t type, uint32_t tag, const char payload[])
+{
+    uint32_t len = strlen(payload);
+    frame_put_header(s->out + s->out_len, type, tag, len);
+    memcpy(s->out + s->out_len + FRAME_HDR_LEN, payload, len);
+    s->out_len += FRAME_HDR_LEN + len;
+}
+
+// queue_login appends a login request for the user of s, with a wrong password
+// if wrong is set
+void queue_login(struct sim* s, bool wrong)
+{
+    char buf[MAXPAIRLEN * 2];
+    snprintf(buf, sizeof buf, "%s,%s%s", usernames[s->cred], passwords[s->cred], wrong ? "x" : "");
+    queue_msg(s, MSG_LOGIN, 0, buf);
+    s->started_us = now_us();
+}
+
+// queue_queries tops the outstanding queries of s up to depth, each asking for
+// one random course, or for several if it is drawn as a batch
+void queue_queries(struct sim* s)
+{
+    char buf[MAXQUERYLEN];
+    while (s->inflight < depth && s->queries_left > 0 && s->out_len <= OUT_BUFLEN - MAXFRAMELEN) {
+        int slot = __builtin_ctz(s->free_slots);
+        int n = rand() % 100 < batch_percent ? 2 + rand() % (max_batch - 1) : 1;
+        const char* category = categories[rand() % NUM_CATEGORIES];
+        int len = 0;
+        for (int i = 0; i < n; i++)
+            len += snprintf(buf + len, sizeof buf - len, "%s%s,%s", i > 0 ? ";" : "", courses[rand() % num_courses], category);
+        // the tag carries the slot, so the answer finds its send time
+        queue_msg(s, MSG_QUERY, s->next_seq++ << 8 | slot, buf);
+        s->sent_us[slot] = now_us();
+        s->slot_batch[slot] = n > 1;
+        s->free_slots &= ~(1u << slot);
+        s->inflight++;
+        s->queries_left--;
+    }
+}
+
+// sim_close ends the session of s
+void sim_close(struct sim* s, bool failed)
+{
+    close(s->fd);
+    s->state = SIM_DONE;
+    sims_done++;
+    if (failed)
+        conn_errors++;
+}
+
+// sim_flush sends as much of the output of s as the socket takes, and waits for
+// it to be writable again only while some is left. Returns -1 if s was closed.
+int sim_flush(struct sim* s)
+{
+    int sent = 0;
+    while (sent < s->out_len) {
+        ssize_t n = send(s->fd, s->out + sent, s->out_len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            sim_close(s, true);
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(s->out, s->out + sent, s->out_len - sent);
+    s->out_len -= sent;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (s->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->fd, &ev);
+    return 0;
+}
+
+// handle_msg acts on one message from serverM. Returns -1 if s was closed.
+int handle_msg(struct sim* s, uint8_t type, uint32_t tag, const char payload[], uint32_t len)
+{
+    if (type == MSG_SESSION)
+        return 0;
+    if (type == MSG_LOGIN_RESULT && s->state == SIM_LOGGING_IN) {
+        if (s->wrong_password && len == 1 && payload[0] == '1') {
+            s->wrong_password = false;
+            queue_login(s, false);
+            return 0;
+        }
+        // serverC did not respond; like the client, try again
+        if (len == 11 && memcmp(payload, "Unavailable", 11) == 0) {
+            unavailable++;
+            queue_login(s, s->wrong_password);
+            return 0;
+        }
+        if (len != 1 || payload[0] != '2') {
+            login_errors++;
+            sim_close(s, false);
+            return -1;
+        }
+        hist_record(&stage_hists[STAGE_LOGIN], now_us() - s->started_us);
+        s->state = SIM_QUERYING;
+        queue_queries(s);
+        return 0;
+    }
+    if (type == MSG_QUERY_RESULT && s->state == SIM_QUERYING) {
+        int slot = tag & 0xff;
+        if (slot >= MAXINFLIGHT || (s->free_slots & (1u << slot))) {
+            sim_close(s, true);
+            return -1;
+        }
+        hist_record(&stage_hists[s->slot_batch[slot] ? STAGE_BATCH : STAGE_QUERY], now_us() - s->sent_us[slot]);
+        if (memmem(payload, len, "Unavailable", 11) != NULL)
+            unavailable++;
+        s->free_slots |= 1u << slot;
+        s->inflight--;
+        if (s->inflight == 0 && s->queries_left == 0) {
+            sim_close(s, false);
+            return -1;
+        }
+        queue_queries(s);
+        return 0;
+    }
+    sim_close(s, true);
+    return -1;
+}
+
+// handle_readable takes the messages serverM sent to s. Returns -1 if s was closed.
+int handle_readable(struct sim* s)
+{
+    ssize_t n = recv(s->fd, s->in + s->in_len, sizeof s->in - s->in_len, 0);
+    if (n <= 0) {
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        sim_close(s, true);
+        return -1;
+    }
+    s->in_len += n;
+    int off = 0;
+    uint8_t type;
+    uint32_t tag, len;
+    int frame_len;
+    while ((frame_len = frame_parse(s->in + off, s->in_len - off, MAXRESPONSELEN, &type, &tag, &len)) > 0) {
+        if (handle_msg(s, type, tag, s->in + off + FRAME_HDR_LEN, len) == -1)
+            return -1;
+        off += frame_len;
+    }
+    if (frame_len == -1) {
+        sim_close(s, true);
+        return -1;
+    }
+    memmove(s->in, s->in + off, s->in_len - off);
+    s->in_len -= off;
+    return sim_flush(s);
+}
+
+// handle_connected finishes the connect of s and sends its first login
+void handle_connected(struct sim* s)
+{
+    int err = 0;
+    socklen_t err_len = sizeof err;
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err != 0) {
+        sim_close(s, true);
+        return;
+    }
+    hist_record(&stage_hists[STAGE_CONNECT], now_us() - s->started_us);
+    s->state = SIM_LOGGING_IN;
+    queue_login(s, s->wrong_password);
+    sim_flush(s);
+}
+
+// sim_start starts the connect of s to serverM at addr
+void sim_start(struct sim* s, struct addrinfo* addr)
+{
+    s->state = SIM_CONNECTING;
+    s->cred = rand() % num_creds;
+    s->wrong_password = rand() % 100 < wrong_password_percent;
+    s->queries_left = queries_per_sim;
+    s->free_slots = depth == 32 ? ~0u : (1u << depth) - 1;
+    s->started_us = now_us();
+    if ((s->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK, addr->ai_protocol)) == -1) {
+        perror("loadgen: socket");
+        exit(1);
+    }
+    if (connect(s->fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS) {
+        sim_close(s, true);
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = s;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+// print_report prints the throughput and latency percentiles of every stage
+void print_report(double seconds)
+{
+    printf("%d clients, %d queries each, depth %d: %.2f s\n", num_sims, queries_per_sim, depth, seconds);
+    printf("%-8s %9s %10s %9s %9s %9s %9s  (latency in us)\n", "stage", "count", "per sec", "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < NUM_STAGES; i++) {
+        struct hist* h = &stage_hists[i];
+        printf("%-8s %9lu %10.0f %9lu %9lu %9lu %9lu\n", stage_names[i], (unsigned long)h->count, h->count / seconds,
+               (unsigned long)hist_percentile(h, 50), (unsigned long)hist_percentile(h, 99),
+               (unsigned long)hist_percentile(h, 99.9), (unsigned long)h->max);
+    }
+    printf("errors: %lu connections failed or closed early, %lu failed logins, %lu unavailable answers\n", conn_errors, login_errors, unavailable);
+}
+
+// loadgen simulates many clients of serverM at once, each logging in with
+// credentials from cred_unencrypted.txt and querying courses from cs.txt and
+// ee.txt, and reports how long each stage took. It is driven by one epoll loop,
+// so thousands of clients need no more than one thread.
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:q:d:b:m:x:t:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': num_sims = atoi(optarg); break;
+        case 'q': queries_per_sim = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'b': batch_percent = atoi(optarg); break;
+        case 'm': max_batch = atoi(optarg); break;
+        case 'x': wrong_password_percent = atoi(optarg); break;
+        case 't': time_limit = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-h host] [-p port] [-c clients] [-q queries_per_client] [-d depth]\n"
+                            "    [-b batch_percent] [-m max_batch] [-x wrong_password_percent] [-t seconds]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (num_sims < 1 || queries_per_sim < 1 || depth < 1 || depth > MAXINFLIGHT || max_batch < 2 || max_batch > MAXBATCH) {
+        fprintf(stderr, "%s: need at least one client and one query per client, a depth between 1 and %d and a batch size between 2 and %d\n", argv[0], MAXINFLIGHT, MAXBATCH);
+        exit(1);
+    }
+
+    num_creds = read_lines("cred_unencrypted.txt", usernames, passwords, MAXCREDS);
+    num_courses = read_lines("cs.txt", courses, NULL, MAXCOURSES);
+    num_courses += read_lines("ee.txt", courses + num_courses, NULL, MAXCOURSES - num_courses);
+    if (num_creds == 0 || num_courses == 0) {
+        fprintf(stderr, "%s: no credentials or no courses to draw from\n", argv[0]);
+        exit(1);
+    }
+    srand(time(NULL));
+
+    // every simulated client needs a descriptor
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)num_sims + 16) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct addrinfo hints, *addr;
+    int rv;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, port, &hints, &addr)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        exit(1);
+    }
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if ((sims = calloc(num_sims, sizeof(struct sim))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    uint64_t start_us = now_us();
+    for (int i = 0; i < num_sims; i++)
+        sim_start(&sims[i], addr);
+    freeaddrinfo(addr);
+
+    struct epoll_event events[MAXEVENTS];
+    uint64_t deadline_us = start_us + (uint64_t)time_limit * 1000000;
+    while (sims_done < (unsigned long)num_sims) {
+        if (now_us() > deadline_us) {
+            fprintf(stderr, "%s: %lu clients did not finish within %d s\n", argv[0], num_sims - sims_done, time_limit);
+            break;
+        }
+        int n = epoll_wait(epfd, events, MAXEVENTS, 1000);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            struct sim* s = events[i].data.ptr;
+            if (s->state == SIM_DONE)
+                continue;
+            if (s->state == SIM_CONNECTING) {
+                handle_connected(s);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && handle_readable(s) == -1)
+                continue;
+            if (events[i].events & EPOLLOUT)
+                sim_flush(s);
+        }
+    }
+    print_report((now_us() - start_us) / 1e6);
+    return sims_done == (unsigned long)num_sims && conn_errors == 0 && login_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "log.h"
+
+
+#define WRITE_BUFLEN 65536  // lines written to stdout with one write()
+#define MAX_IDLE_NS 32000000  // longest the writer sleeps while the ring is empty
+
+// log_entry is one slot of the ring. Its sequence number tells whose turn it is:
+// equal to the position of a producer that may fill it, one more once filled and
+// ready for the writer, and LOG_RING_SIZE more once the writer has emptied it.
+struct log_entry {
+    _Atomic size_t seq;
+    int len;
+    char text[LOG_LINE_MAX];
+};
+
+enum log_level log_level = LEVEL_INFO;
+int log_sample = 1;
+
+static struct log_entry ring[LOG_RING_SIZE];
+static _Atomic size_t enqueue_pos;  // next position a producer claims
+static size_t dequeue_pos;  // next position the writer takes; only it touches this
+static _Atomic unsigned long dropped;  // lines lost because the ring was full
+static _Atomic size_t written_pos;  // every position before this one has been written
+static atomic_bool started;  // until the writer runs, lines are written directly
+static _Thread_local unsigned long sample_count;  // LEVEL_INFO lines seen by this thread
+static const char* const level_names[] = { "error", "notice", "info", "debug" };
+
+
+// log_parse_options sets the level from its name or number and the sampling of
+// LEVEL_INFO lines, either of which may be NULL. Returns -1 if one is invalid.
+int log_parse_options(const char* level, const char* sample)
+{
+    if (level != NULL) {
+        int l = -1;
+        for (int i = 0; i <= LEVEL_DEBUG; i++) {
+            if (strcasecmp(level, level_names[i]) == 0)
+                l = i;
+        }
+        if (l == -1 && level[0] >= '0' && level[0] <= '0' + LEVEL_DEBUG && level[1] == '\0')
+            l = level[0] - '0';
+        if (l == -1)
+            return -1;
+        log_level = l;
+    }
+    if (sample != NULL) {
+        log_sample = atoi(sample);
+        if (log_sample < 1)
+            return -1;
+    }
+    return 0;
+}
+
+// log_write formats a line into the ring. If the ring is full the line is
+// dropped, and counted, rather than making the caller wait for the writer.
+void log_write(enum log_level level, const char* fmt, ...)
+{
+    va_list ap;
+    if (level == LEVEL_INFO && log_sample > 1 && sample_count++ % log_sample != 0)
+        return;
+    if (!atomic_load_explicit(&started, memory_order_acquire)) {
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        fflush(stdout);
+        return;
+    }
+    // claim a slot: the one at enqueue_pos, once the writer has emptied it
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    struct log_entry* e;
+    while (1) {
+        e = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (seq < pos) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    }
+    va_start(ap, fmt);
+    int len = vsnprintf(e->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+        e->text[len - 1] = '\n';
+    }
+    e->len = len;
+    atomic_store_explicit(&e->seq, pos + 1, memory_order_release);
+}
+
+// write_all writes len bytes of buf to stdout
+static void write_all(const char* buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// writer_main is the loop of the writer thread. It copies the filled slots into
+// a buffer and writes it out whenever it is full or the ring runs dry; while the
+// ring stays empty it sleeps, longer and longer up to MAX_IDLE_NS.
+static void* writer_main(void* arg)
+{
+    (void)arg;
+    static char buf[WRITE_BUFLEN];
+    size_t len = 0;
+    unsigned long reported = 0;
+    struct timespec idle = { 0, 0 };
+    while (1) {
+        struct log_entry* e = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&e->seq, memory_order_acquire) == dequeue_pos + 1) {
+            if (len + e->len > WRITE_BUFLEN) {
+                write_all(buf, len);
+                len = 0;
+                atomic_store_explicit(&written_pos, dequeue_pos, memory_order_release);
+            }
+            memcpy(buf + len, e->text, e->len);
+            len += e->len;
+            atomic_store_explicit(&e->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+            dequeue_pos++;
+            idle.tv_nsec = 0;
+            continue;
+        }
+        if (len > 0) {
+            write_all(buf, len);
+            len = 0;
+        }
+        unsigned long lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if (lost != reported) {
+            char note[64];
+            write_all(note, snprintf(note, sizeof note, "(%lu log lines dropped)\n", lost - reported));
+            reported = lost;
+        }
+        atomic_store_explicit(&written_pos, dequeue_pos, memory_order_release);
+        idle.tv_nsec = idle.tv_nsec == 0 ? 1000000 : idle.tv_nsec * 2;
+        if (idle.tv_nsec > MAX_IDLE_NS)
+            idle.tv_nsec = MAX_IDLE_NS;
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// log_start starts the writer thread; what is still queued when the process
+// exits is written first. The thread starts with every signal blocked, so
+// signals the server handles, such as SIGUSR1, are never delivered to it.
+// Returns -1 on failure.
+int log_start(void)
+{
+    pthread_t thread;
+    sigset_t all, old;
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init(&ring[i].seq, i);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&thread, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    fflush(stdout);
+    atomic_store_explicit(&started, true, memory_order_release);
+    atexit(log_flush);
+    return 0;
+}
+
+// log_flush waits until every line logged before the call has been written
+void log_flush(void)
+{
+    if (!atomic_load_explicit(&started, memory_order_acquire))
+        return;
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    struct timespec pause = { 0, 1000000 };
+    while (atomic_load_explicit(&written_pos, memory_order_acquire) < pos)
+        nanosleep(&pause, NULL);
+}
@@ -0,0 +1,33 @@
+// log.h declares the asynchronous logger of the servers. A log line is formatted
+// into a slot of a lock-free ring buffer by the thread logging it and written to
+// stdout by a background thread, in batches, so logging never waits on the
+// terminal or pipe behind stdout.
+#ifndef LOG_H
+#define LOG_H
+
+enum log_level {
+    LEVEL_ERROR,
+    LEVEL_NOTICE,  // startup, reloads, health changes, statistics
+    LEVEL_INFO,  // one line per step of every request
+    LEVEL_DEBUG
+};
+
+#define LOG_LINE_MAX 256  // longer lines are cut short
+#define LOG_RING_SIZE 4096  // lines queued for the writer; must be a power of two
+
+extern enum log_level log_level;  // lines above this level are skipped
+extern int log_sample;  // only one in log_sample lines at LEVEL_INFO is kept
+
+// the level is tested before the arguments are evaluated, so a line that is
+// turned off costs a comparison
+#define log_error(...) do { if (LEVEL_ERROR <= log_level) log_write(LEVEL_ERROR, __VA_ARGS__); } while (0)
+#define log_notice(...) do { if (LEVEL_NOTICE <= log_level) log_write(LEVEL_NOTICE, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (LEVEL_INFO <= log_level) log_write(LEVEL_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (LEVEL_DEBUG <= log_level) log_write(LEVEL_DEBUG, __VA_ARGS__); } while (0)
+
+int log_parse_options(const char* level, const char* sample);
+int log_start(void);
+void log_write(enum log_level level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+
+#endif
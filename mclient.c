@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#include "mclient.h"
+
+
+// tcp_connect connects to serverM at host and port. Returns the blocking socket,
+// or -1 on failure.
+static int tcp_connect(const char* host, const char* port)
+{
+    struct addrinfo hints, *servinfo, *p;
+    int sockfd = -1;
+    int yes = 1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &servinfo) != 0)
+        return -1;
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+            continue;
+        if (connect(sockfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(servinfo);
+    // queries are small and latency matters more than packing them
+    if (sockfd != -1)
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    return sockfd;
+}
+
+// send_frame sends one message on a blocking socket. Returns -1 on failure.
+static int send_frame(int fd, uint8_t type, const char payload[])
+{
+    char frame[MCLIENT_MAXFRAMELEN];
+    uint32_t len = strlen(payload);
+    if (len > MCLIENT_MAXLEN)
+        return -1;
+    frame_put_header(frame, type, 0, len);
+    memcpy(frame + FRAME_HDR_LEN, payload, len);
+    for (uint32_t sent = 0; sent < FRAME_HDR_LEN + len; ) {
+        ssize_t n = send(fd, frame + sent, FRAME_HDR_LEN + len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+// recv_frame receives the next message on the blocking socket of c into payload,
+// which holds MCLIENT_MAXLEN + 1 bytes. Returns its type, or -1 on failure.
+static int recv_frame(struct mclient_conn* c, char payload[])
+{
+    uint8_t type;
+    uint32_t tag, len;
+    int frame_len;
+    while ((frame_len = frame_parse(c->in, c->in_len, MCLIENT_MAXLEN, &type, &tag, &len)) == 0) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        c->in_len += n;
+    }
+    if (frame_len == -1)
+        return -1;
+    memcpy(payload, c->in + FRAME_HDR_LEN, len);
+    payload[len] = '\0';
+    memmove(c->in, c->in + frame_len, c->in_len - frame_len);
+    c->in_len -= frame_len;
+    return type;
+}
+
+// conn_login connects c and logs it in: with the session token of the pool if
+// it has one, which does not involve serverC, and with the password otherwise or
+// if the token is refused. Returns MCLIENT_OK, MCLIENT_ERROR or MCLIENT_DENIED.
+static int conn_login(struct mclient* mc, struct mclient_conn* c)
+{
+    char buf[MCLIENT_MAXLEN + 1];
+    int type;
+    if ((c->fd = tcp_connect(mc->host, mc->port)) == -1)
+        return MCLIENT_ERROR;
+    c->in_len = 0;
+    c->out_len = 0;
+
+    bool resumed = false;
+    if (mc->token[0] != '\0') {
+        if (send_frame(c->fd, MSG_RESUME, mc->token) == -1 || recv_frame(c, buf) != MSG_LOGIN_RESULT)
+            goto fail;
+        resumed = strcmp(buf, "2") == 0;
+    }
+    if (!resumed) {
+        snprintf(buf, sizeof buf, "%s,%s", mc->username, mc->password);
+        if (send_frame(c->fd, MSG_LOGIN, buf) == -1 || recv_frame(c, buf) != MSG_LOGIN_RESULT)
+            goto fail;
+        if (strcmp(buf, "2") != 0) {
+            close(c->fd);
+            c->fd = -1;
+            return strcmp(buf, "Unavailable") == 0 ? MCLIENT_ERROR : MCLIENT_DENIED;
+        }
+        // serverM follows a successful login with a session token, if it issues them
+        mc->token[0] = '\0';
+        struct epoll_event ev;
+        int epfd = epoll_create1(0);
+        ev.events = EPOLLIN;
+        ev.data.fd = c->fd;
+        if (epfd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == 0
+                && (c->in_len > 0 || epoll_wait(epfd, &ev, 1, 100) == 1)) {
+            if ((type = recv_frame(c, buf)) == -1) {
+                close(epfd);
+                goto fail;
+            }
+            if (type == MSG_SESSION && strlen(buf) < sizeof mc->token)
+                strcpy(mc->token, buf);
+        }
+        if (epfd != -1)
+            close(epfd);
+    }
+
+    // from now on the connection is driven by mclient_poll
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) == -1
+            || epoll_ctl(mc->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        goto fail;
+    return MCLIENT_OK;
+
+fail:
+    close(c->fd);
+    c->fd = -1;
+    return MCLIENT_ERROR;
+}
+
+// conn_fail closes c after an error and fails every query still waiting on it.
+// The calls are detached and c reset before any callback runs, since a callback
+// may send a query that logs c in again.
+static void conn_fail(struct mclient* mc, struct mclient_conn* c)
+{
+    struct mclient_call failed[MAXINFLIGHT];
+    int num_failed = 0;
+    close(c->fd);
+    c->fd = -1;
+    c->in_len = 0;
+    c->out_len = 0;
+    c->resets++;
+    for (int i = 0; i < MAXINFLIGHT; i++) {
+        if (!c->calls[i].in_use)
+            continue;
+        failed[num_failed++] = c->calls[i];
+        c->calls[i].in_use = false;
+    }
+    c->inflight = 0;
+    mc->outstanding -= num_failed;
+    for (int i = 0; i < num_failed; i++)
+        failed[i].cb(failed[i].arg, MCLIENT_ERROR, NULL);
+}
+
+// conn_flush sends as much queued output of c as the socket takes, and asks to
+// be told when it is writable again only while some is left. Returns -1 if the
+// connection failed.
+static int conn_flush(struct mclient* mc, struct mclient_conn* c)
+{
+    int sent = 0;
+    while (sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            conn_fail(mc, c);
+            return -1;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(mc->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+// conn_readable takes the answers serverM sent on c and hands each one to the
+// callback of its query; a session token is kept for logging in again. Returns the number of answers, or -1 if the connection
+// failed.
+static int conn_readable(struct mclient* mc, struct mclient_conn* c)
+{
+    char answer[MCLIENT_MAXANSWERLEN + 1];
+    int answers = 0;
+    while (1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn_fail(mc, c);
+            return -1;
+        }
+        c->in_len += n;
+
+        int off = 0;
+        int frame_len;
+        uint8_t type;
+        uint32_t tag, len;
+        while ((frame_len = frame_parse(c->in + off, c->in_len - off, MCLIENT_MAXANSWERLEN, &type, &tag, &len)) > 0) {
+            if (type != MSG_SESSION && (type != MSG_QUERY_RESULT || tag >= MAXINFLIGHT || !c->calls[tag].in_use)) {
+                conn_fail(mc, c);
+                return -1;
+            }
+            memcpy(answer, c->in + off + FRAME_HDR_LEN, len);
+            answer[len] = '\0';
+            off += frame_len;
+            // a session token that came after conn_login stopped waiting for it
+            if (type == MSG_SESSION) {
+                if (len < sizeof mc->token)
+                    strcpy(mc->token, answer);
+                continue;
+            }
+            // free the slot first, so the callback can reuse it for a new query
+            struct mclient_call call = c->calls[tag];
+            c->calls[tag].in_use = false;
+            c->inflight--;
+            mc->outstanding--;
+            unsigned int resets = c->resets;
+            call.cb(call.arg, MCLIENT_OK, answer);
+            answers++;
+            // the callback may have sent a query that failed the connection, and
+            // maybe logged it in again; what was buffered for it is gone either way
+            if (c->resets != resets)
+                return answers;
+        }
+        if (frame_len == -1) {
+            conn_fail(mc, c);
+            return -1;
+        }
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+    }
+    return answers;
+}
+
+// mclient_open connects num_conns connections to serverM at host and port (NULL
+// for the defaults) and logs them in as username. Returns MCLIENT_OK, or
+// MCLIENT_DENIED if the login was refused and MCLIENT_ERROR if no connection
+// could be made, in which case there is nothing to close.
+int mclient_open(struct mclient* mc, const char* host, const char* port, const char* username,
+                 const char* password, int num_conns)
+{
+    if (num_conns < 1 || num_conns > MCLIENT_MAXCONNS)
+        return MCLIENT_ERROR;
+    memset(mc, 0, sizeof *mc);
+    snprintf(mc->host, sizeof mc->host, "%s", host != NULL ? host : MCLIENT_HOST);
+    snprintf(mc->port, sizeof mc->port, "%s", port != NULL ? port : MCLIENT_PORT);
+    snprintf(mc->username, sizeof mc->username, "%s", username);
+    snprintf(mc->password, sizeof mc->password, "%s", password);
+    mc->num_conns = num_conns;
+    if ((mc->epfd = epoll_create1(0)) == -1)
+        return MCLIENT_ERROR;
+    if ((mc->conns = calloc(num_conns, sizeof(struct mclient_conn))) == NULL) {
+        close(mc->epfd);
+        return MCLIENT_ERROR;
+    }
+    for (int i = 0; i < num_conns; i++)
+        mc->conns[i].fd = -1;
+    int rv = MCLIENT_OK;
+    for (int i = 0; i < num_conns && rv == MCLIENT_OK; i++)
+        rv = conn_login(mc, &mc->conns[i]);
+    if (rv != MCLIENT_OK) {
+        for (int i = 0; i < num_conns; i++) {
+            if (mc->conns[i].fd != -1)
+                close(mc->conns[i].fd);
+        }
+        free(mc->conns);
+        close(mc->epfd);
+    }
+    return rv;
+}
+
+// mclient_query sends query, "course,category" or several of them separated by
+// ';', on the least busy connection of the pool, without waiting for it to be
+// sent; cb is called with the answer from mclient_poll. A dropped connection is
+// logged in again first. Returns MCLIENT_OK, MCLIENT_BUSY if every connection has
+// as many queries outstanding as serverM allows, or MCLIENT_ERROR if the query is
+// too long, no connection can be made or the connection failed while sending it;
+// cb is not called for a query that was not accepted.
+int mclient_query(struct mclient* mc, const char* query, mclient_callback cb, void* arg)
+{
+    uint32_t len = strlen(query);
+    if (len > MCLIENT_MAXLEN)
+        return MCLIENT_ERROR;
+
+    struct mclient_conn* best = NULL;
+    for (int i = 0; i < mc->num_conns; i++) {
+        struct mclient_conn* c = &mc->conns[(mc->next_conn + i) % mc->num_conns];
+        if (c->fd != -1 && c->inflight < MAXINFLIGHT && (best == NULL || c->inflight < best->inflight))
+            best = c;
+    }
+    if (best == NULL) {
+        for (int i = 0; i < mc->num_conns && best == NULL; i++) {
+            if (mc->conns[i].fd == -1 && conn_login(mc, &mc->conns[i]) == MCLIENT_OK)
+                best = &mc->conns[i];
+        }
+        if (best == NULL)
+            return mc->outstanding > 0 ? MCLIENT_BUSY : MCLIENT_ERROR;
+    }
+    mc->next_conn = (best - mc->conns + 1) % mc->num_conns;
+
+    int tag = 0;
+    while (best->calls[tag].in_use)
+        tag++;
+    frame_put_header(best->out + best->out_len, MSG_QUERY, tag, len);
+    memcpy(best->out + best->out_len + FRAME_HDR_LEN, query, len);
+    best->out_len += FRAME_HDR_LEN + len;
+    // the call is taken only once the query is on its way, so a connection that
+    // fails now does not also report this query to cb
+    if (conn_flush(mc, best) == -1)
+        return MCLIENT_ERROR;
+    best->calls[tag].in_use = true;
+    best->calls[tag].cb = cb;
+    best->calls[tag].arg = arg;
+    best->inflight++;
+    mc->outstanding++;
+    return MCLIENT_OK;
+}
+
+// mclient_poll waits up to timeout_ms (-1 for no limit) for the pool to make
+// progress, then sends what it can and hands every answer received to its
+// callback. Returns the number of answers, or -1 on failure.
+int mclient_poll(struct mclient* mc, int timeout_ms)
+{
+    struct epoll_event events[MCLIENT_MAXCONNS];
+    int n = epoll_wait(mc->epfd, events, MCLIENT_MAXCONNS, timeout_ms);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+    int answers = 0;
+    for (int i = 0; i < n; i++) {
+        struct mclient_conn* c = events[i].data.ptr;
+        if (c->fd == -1)
+            continue;
+        if ((events[i].events & EPOLLOUT) && conn_flush(mc, c) == -1)
+            continue;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            int rv = conn_readable(mc, c);
+            if (rv > 0)
+                answers += rv;
+        }
+    }
+    return answers;
+}
+
+// mclient_outstanding returns the number of queries not answered yet
+int mclient_outstanding(const struct mclient* mc)
+{
+    return mc->outstanding;
+}
+
+// mclient_fd returns a descriptor that is readable when mclient_poll has work,
+// to wait on from the caller's own event loop
+int mclient_fd(const struct mclient* mc)
+{
+    return mc->epfd;
+}
+
+// mclient_close closes every connection; queries still outstanding get no answer
+void mclient_close(struct mclient* mc)
+{
+    for (int i = 0; i < mc->num_conns; i++) {
+        if (mc->conns[i].fd != -1)
+            close(mc->conns[i].fd);
+    }
+    free(mc->conns);
+    close(mc->epfd);
+}
@@ -0,0 +1,84 @@
+// mclient.h declares the client library for serverM. It keeps a pool of
+// connections that are logged in once, when the pool is opened, and sends course
+// queries over them without blocking; each answer is handed to a callback as it
+// arrives. Reconnecting a dropped connection uses the session token of the first
+// login, so serverC is asked for the password only once.
+//
+//     struct mclient mc;
+//     if (mclient_open(&mc, NULL, NULL, "james", "2kAnsa7s)", 4) != MCLIENT_OK) ...
+//     mclient_query(&mc, "CS100,Credit;EE450,Days", print_answer, NULL);
+//     while (mclient_outstanding(&mc) > 0)
+//         mclient_poll(&mc, -1);
+//     mclient_close(&mc);
+#ifndef MCLIENT_H
+#define MCLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "protocol.h"
+#include "session.h"
+
+#define MCLIENT_HOST "127.0.0.1"
+#define MCLIENT_PORT "25893"
+#define MCLIENT_MAXCONNS 64
+#define MCLIENT_MAXLEN MAXQUERYLEN  // longest query
+#define MCLIENT_MAXANSWERLEN MAXRESPONSELEN  // longest answer: one per course
+#define MCLIENT_MAXFRAMELEN (FRAME_HDR_LEN + MCLIENT_MAXLEN)
+
+enum mclient_status {
+    MCLIENT_OK = 0,
+    MCLIENT_ERROR = -1,  // could not connect, or the connection was lost
+    MCLIENT_DENIED = -2,  // serverM refused the login
+    MCLIENT_BUSY = -3  // every connection has MAXINFLIGHT queries outstanding
+};
+
+// mclient_callback receives the answer to a query: status is MCLIENT_OK and
+// answer holds one line per course asked about, or status is MCLIENT_ERROR and
+// answer is NULL if the connection was lost first. answer is only valid during
+// the call. The callback may send further queries.
+typedef void (*mclient_callback)(void* arg, int status, const char* answer);
+
+// mclient_call is a query waiting for its answer
+struct mclient_call {
+    bool in_use;
+    mclient_callback cb;
+    void* arg;
+};
+
+// mclient_conn is one connection of the pool. The tag of a query is the index
+// of its call slot.
+struct mclient_conn {
+    int fd;  // -1 while disconnected
+    unsigned int resets;  // times the connection failed, so a loop can tell it was reset under it
+    struct mclient_call calls[MAXINFLIGHT];
+    int inflight;
+    char in[2 * (FRAME_HDR_LEN + MCLIENT_MAXANSWERLEN)];  // received bytes not yet parsed into answers
+    int in_len;
+    char out[MAXINFLIGHT * MCLIENT_MAXFRAMELEN];  // queries not yet sent
+    int out_len;
+};
+
+// mclient is a pool of connections to serverM, all logged in as the same user
+struct mclient {
+    char host[64];
+    char port[8];
+    char username[100];
+    char password[100];  // for reconnecting if serverM issues no session tokens
+    char token[MAXTOKENLEN];  // empty if serverM issues no session tokens
+    int epfd;
+    struct mclient_conn* conns;
+    int num_conns;
+    int next_conn;  // where the search for the least busy connection starts
+    int outstanding;  // queries sent and not answered, over every connection
+};
+
+int mclient_open(struct mclient* mc, const char* host, const char* port, const char* username,
+                 const char* password, int num_conns);
+int mclient_query(struct mclient* mc, const char* query, mclient_callback cb, void* arg);
+int mclient_poll(struct mclient* mc, int timeout_ms);
+int mclient_outstanding(const struct mclient* mc);
+int mclient_fd(const struct mclient* mc);
+void mclient_close(struct mclient* mc);
+
+#endif
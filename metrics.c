@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "log.h"
+
+
+// metrics_init sets up m with num_slots zeroed slots. Returns -1 on failure.
+int metrics_init(struct metrics* m, const char* name, const char* const stage_names[], int num_stages,
+                 const char* const counter_names[], int num_counters, int num_slots)
+{
+    m->name = name;
+    m->stage_names = stage_names;
+    m->num_stages = num_stages;
+    m->counter_names = counter_names;
+    m->num_counters = num_counters;
+    m->num_slots = num_slots;
+    m->slots = aligned_alloc(64, num_slots * sizeof(struct metrics_slot));
+    if (m->slots == NULL) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    memset(m->slots, 0, num_slots * sizeof(struct metrics_slot));
+    return 0;
+}
+
+// metrics_now_ns returns the monotonic time in nanoseconds, to measure stages with
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// bump adds n to a value only the calling thread writes; a plain load and store
+// suffice, and are much cheaper than an atomic increment
+static inline void bump(_Atomic uint64_t* v, uint64_t n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// metrics_record counts one latency of stage in the slot of the calling thread
+void metrics_record(struct metrics_slot* s, int stage, uint64_t ns)
+{
+    bump(&s->counts[stage][hist_bucket(ns)], 1);
+    bump(&s->count[stage], 1);
+    bump(&s->sum[stage], ns);
+    if (ns > atomic_load_explicit(&s->max[stage], memory_order_relaxed))
+        atomic_store_explicit(&s->max[stage], ns, memory_order_relaxed);
+}
+
+// metrics_count adds n to counter in the slot of the calling thread
+void metrics_count(struct metrics_slot* s, int counter, uint64_t n)
+{
+    bump(&s->counters[counter], n);
+}
+
+// metrics_dump prints the counters of m and the latency percentiles of each of
+// its stages, merged over every slot
+void metrics_dump(const struct metrics* m)
+{
+    struct hist h;
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof line, "%s metrics:", m->name);
+    for (int c = 0; c < m->num_counters && len < (int)sizeof line; c++) {
+        uint64_t total = 0;
+        for (int i = 0; i < m->num_slots; i++)
+            total += atomic_load_explicit(&m->slots[i].counters[c], memory_order_relaxed);
+        len += snprintf(line + len, sizeof line - len, "%s %llu %s", c > 0 ? "," : "", (unsigned long long)total, m->counter_names[c]);
+    }
+    log_notice("%s\n", line);
+    for (int stage = 0; stage < m->num_stages; stage++) {
+        memset(&h, 0, sizeof h);
+        for (int i = 0; i < m->num_slots; i++) {
+            const struct metrics_slot* s = &m->slots[i];
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                h.counts[b] += atomic_load_explicit(&s->counts[stage][b], memory_order_relaxed);
+            h.count += atomic_load_explicit(&s->count[stage], memory_order_relaxed);
+            h.sum += atomic_load_explicit(&s->sum[stage], memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&s->max[stage], memory_order_relaxed);
+            if (max > h.max)
+                h.max = max;
+        }
+        log_notice("  %s: %llu samples, mean %llu ns, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+               m->stage_names[stage], (unsigned long long)h.count,
+               (unsigned long long)(h.count > 0 ? h.sum / h.count : 0),
+               (unsigned long long)hist_percentile(&h, 50),
+               (unsigned long long)hist_percentile(&h, 99),
+               (unsigned long long)hist_percentile(&h, 99.9),
+               (unsigned long long)h.max);
+    }
+}
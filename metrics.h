@@ -0,0 +1,45 @@
+// metrics.h declares the counters and per-stage latency histograms the servers
+// keep about themselves. Every thread records into a slot of its own, so
+// recording takes no lock and no atomic read-modify-write; a dump merges the
+// slots while they are being written.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "hist.h"
+
+#define METRICS_MAXSTAGES 8
+#define METRICS_MAXCOUNTERS 8
+
+// metrics_slot holds what one thread recorded. Only its thread writes it, with
+// relaxed loads and stores, so another thread may read it at any time.
+struct metrics_slot {
+    _Atomic uint64_t counts[METRICS_MAXSTAGES][HIST_BUCKETS];
+    _Atomic uint64_t count[METRICS_MAXSTAGES];
+    _Atomic uint64_t sum[METRICS_MAXSTAGES];
+    _Atomic uint64_t max[METRICS_MAXSTAGES];
+    _Atomic uint64_t counters[METRICS_MAXCOUNTERS];
+} __attribute__((aligned(64)));
+
+// metrics names the stages, whose latencies are recorded in nanoseconds, and the
+// counters of a server, and holds one slot per thread recording them
+struct metrics {
+    const char* name;  // e.g. "ServerC", used in the dump
+    const char* const* stage_names;
+    int num_stages;
+    const char* const* counter_names;
+    int num_counters;
+    struct metrics_slot* slots;
+    int num_slots;
+};
+
+int metrics_init(struct metrics* m, const char* name, const char* const stage_names[], int num_stages,
+                 const char* const counter_names[], int num_counters, int num_slots);
+uint64_t metrics_now_ns(void);
+void metrics_record(struct metrics_slot* s, int stage, uint64_t ns);
+void metrics_count(struct metrics_slot* s, int counter, uint64_t n);
+void metrics_dump(const struct metrics* m);
+
+#endif
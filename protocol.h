@@ -0,0 +1,121 @@
+// protocol.h holds the message formats shared by serverM and the servers C/CS/EE
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Every UDP datagram between serverM and the servers C/CS/EE starts with a
+// 4-byte request ID in network byte order, followed by the string message.
+// serverM picks the ID, the servers copy it unchanged into their response, and
+// serverM uses it to route the response back to the request that is waiting on it.
+// A datagram with nothing after the request ID is a health probe, which the
+// servers answer with an equally empty datagram.
+#define UDP_HDR_LEN 4
+
+// udp_get_req_id reads the request ID at the start of a datagram
+static inline uint32_t udp_get_req_id(const char datagram[])
+{
+    uint32_t req_id;
+    memcpy(&req_id, datagram, sizeof req_id);
+    return ntohl(req_id);
+}
+
+// udp_put_req_id writes the request ID at the start of a datagram
+static inline void udp_put_req_id(char datagram[], uint32_t req_id)
+{
+    req_id = htonl(req_id);
+    memcpy(datagram, &req_id, sizeof req_id);
+}
+
+// serverC also takes many credentials in one datagram: BATCH_AUTH_MARK followed
+// by "username,password" pairs, password encrypted, each on its own line. It is
+// answered with a packed result vector, one 2-bit result per pair in request
+// order, four to a byte starting from the low bits: 2 for success, 1 for a wrong
+// password and 0 for an unknown username, as in the answer to a single pair.
+// A batch of no pairs is answered with BATCH_AUTH_EMPTY, since an empty result
+// vector would read as the answer to a health probe.
+#define BATCH_AUTH_MARK "*\n"
+#define BATCH_AUTH_MARK_LEN 2
+#define BATCH_AUTH_EMPTY "Empty"
+
+// batch_auth_result reads the result of pair i from a packed result vector
+static inline int batch_auth_result(const char results[], int i)
+{
+    return ((unsigned char)results[i / 4] >> (i % 4 * 2)) & 3;
+}
+
+// A course query asks for one category (Credit, Professor, Days or CourseName),
+// several joined by CATEGORY_SEP, e.g. "Credit+Days", or CATEGORY_ALL for the
+// whole record. serverCS/serverEE answer several categories with their values
+// in file order, separated by ',' as in the data file. An answer to one course
+// query is at most MAXANSWERLEN bytes, NUL included.
+#define CATEGORY_SEP '+'
+#define CATEGORY_ALL "All"
+#define MAXANSWERLEN 256
+
+// Messages between the client and serverM over TCP are framed: a 4-byte payload
+// length, a 1-byte message type and a 4-byte tag, all in network byte order,
+// followed by the payload string without a terminating NUL. Framing lets a reader
+// reassemble a message split across several recv()s and pull several pipelined
+// messages out of a single one. The tag is chosen by the client and copied into
+// the response by serverM, so a client with many requests outstanding on one
+// connection can match the responses, which arrive in completion order.
+#define FRAME_HDR_LEN 9
+
+enum msg_type {
+    MSG_LOGIN = 1,      // client -> serverM: "username,password"
+    MSG_LOGIN_RESULT,   // serverM -> client: "2", "1" or "0"
+    MSG_QUERY,          // client -> serverM: "course,category[;course,category...]"
+    MSG_QUERY_RESULT,   // serverM -> client: one answer per course, separated by newlines
+    MSG_SESSION,        // serverM -> client: session token, right after a "2" login result
+    MSG_RESUME          // client -> serverM: session token, in place of a login; answered
+                        // with a login result of "2", or "Invalid" if the token is not valid
+};
+
+// A query request holds up to MAXBATCH "course,category" pairs of up to
+// MAXPAIRLEN bytes each, and a client may have up to MAXINFLIGHT query requests
+// outstanding on one connection. serverM answers a request of more pairs with
+// TOO_MANY_QUERIES alone, in place of one answer per pair, and a pair of
+// MAXPAIRLEN bytes or more with TOO_LONG_QUERY.
+#define MAXBATCH 20
+#define MAXPAIRLEN 100
+#define MAXQUERYLEN (MAXBATCH * MAXPAIRLEN)  // longest query request
+#define MAXRESPONSELEN (MAXBATCH * MAXANSWERLEN)  // longest query response, NUL included
+#define MAXINFLIGHT 32
+#define TOO_MANY_QUERIES "TooMany"
+#define TOO_LONG_QUERY "TooLong"
+
+// frame_put_header writes the header of a frame carrying len bytes of payload
+static inline void frame_put_header(char frame[], uint8_t type, uint32_t tag, uint32_t len)
+{
+    uint32_t net_len = htonl(len);
+    uint32_t net_tag = htonl(tag);
+    memcpy(frame, &net_len, sizeof net_len);
+    frame[4] = type;
+    memcpy(frame + 5, &net_tag, sizeof net_tag);
+}
+
+// frame_parse inspects the avail bytes at the start of buf. Returns the length of
+// the frame found there, header included, and stores its type, tag and payload
+// length; returns 0 if the frame is not complete yet, or -1 if its payload is
+// longer than max_len.
+static inline int frame_parse(const char buf[], size_t avail, size_t max_len, uint8_t* type, uint32_t* tag, uint32_t* len)
+{
+    uint32_t net_len, net_tag;
+    if (avail < FRAME_HDR_LEN)
+        return 0;
+    memcpy(&net_len, buf, sizeof net_len);
+    memcpy(&net_tag, buf + 5, sizeof net_tag);
+    *len = ntohl(net_len);
+    *type = buf[4];
+    *tag = ntohl(net_tag);
+    if (*len > max_len)
+        return -1;
+    if (avail < FRAME_HDR_LEN + *len)
+        return 0;
+    return FRAME_HDR_LEN + *len;
+}
+
+#endif
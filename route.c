@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "route.h"
+
+
+// hash_str computes the FNV-1a hash of a NUL-terminated string, finished with
+// the MurmurHash3 mixer so that similar strings land far apart on the ring
+static uint32_t hash_str(const char* str)
+{
+    uint32_t hash = 2166136261u;
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// compare_ring_points orders ring points by hash, for qsort()
+static int compare_ring_points(const void* a, const void* b)
+{
+    uint32_t ha = ((const struct ring_point*)a)->hash;
+    uint32_t hb = ((const struct ring_point*)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// build_ring places RING_POINTS points per endpoint of b on its ring
+static void build_ring(struct backend* b)
+{
+    char point[128];
+    b->ring_len = 0;
+    for (int i = 0; i < b->num_endpoints; i++) {
+        for (int v = 0; v < RING_POINTS; v++) {
+            snprintf(point, sizeof point, "%s:%s#%d", b->endpoints[i].host, b->endpoints[i].port, v);
+            b->ring[b->ring_len].hash = hash_str(point);
+            b->ring[b->ring_len].endpoint = i;
+            b->ring_len++;
+        }
+    }
+    qsort(b->ring, b->ring_len, sizeof(struct ring_point), compare_ring_points);
+}
+
+// find_backend returns the backend called name, or NULL
+static struct backend* find_backend(struct routing* r, const char* name)
+{
+    for (int i = 0; i < r->num_backends; i++) {
+        if (strcmp(r->backends[i].name, name) == 0)
+            return &r->backends[i];
+    }
+    return NULL;
+}
+
+// parse_endpoint splits "host:port", or "[host]:port" for an IPv6 address, into
+// e. Returns -1 if it is malformed.
+static int parse_endpoint(struct endpoint* e, char str[])
+{
+    char* colon = strrchr(str, ':');
+    if (colon == NULL || colon == str || colon[1] == '\0' || strlen(colon + 1) >= sizeof e->port)
+        return -1;
+    *colon = '\0';
+    if (str[0] == '[' && colon[-1] == ']') {
+        str++;
+        colon[-1] = '\0';
+    }
+    if (strlen(str) >= sizeof e->host)
+        return -1;
+    strcpy(e->host, str);
+    strcpy(e->port, colon + 1);
+    e->addr = NULL;
+    e->healthy = true;
+    return 0;
+}
+
+// parse_routing reads a routing table from text, which is modified in place.
+// Each line holds one directive, and '#' starts a comment:
+//
+//     backend <name> <host>:<port> [<host>:<port> ...]
+//     route <prefix> <backend>
+//     auth <backend>
+//
+// "backend" names a group of instances, "route" sends the course codes starting
+// with prefix to a backend (the longest matching prefix wins) and "auth" sends
+// the authentication requests to one. Errors are reported against source.
+// Returns -1 if the table is malformed.
+int parse_routing(struct routing* r, char text[], const char* source)
+{
+    int line_no = 0;
+    char* line_save;
+    memset(r, 0, sizeof *r);
+    for (char* line = strtok_r(text, "\n", &line_save); line != NULL; line = strtok_r(NULL, "\n", &line_save)) {
+        line_no++;
+        line[strcspn(line, "#")] = '\0';
+        char* save;
+        char* directive = strtok_r(line, " \t\r", &save);
+        if (directive == NULL)
+            continue;
+        char* name = strtok_r(NULL, " \t\r", &save);
+        if (name == NULL || strlen(name) >= MAXNAMELEN) {
+            fprintf(stderr, "%s:%d: missing or overlong name\n", source, line_no);
+            return -1;
+        }
+        if (strcmp(directive, "backend") == 0) {
+            if (find_backend(r, name) != NULL || r->num_backends == MAXBACKENDS) {
+                fprintf(stderr, "%s:%d: duplicate backend, or more than %d\n", source, line_no, MAXBACKENDS);
+                return -1;
+            }
+            struct backend* b = &r->backends[r->num_backends++];
+            strcpy(b->name, name);
+            for (char* endpoint = strtok_r(NULL, " \t\r", &save); endpoint != NULL; endpoint = strtok_r(NULL, " \t\r", &save)) {
+                if (b->num_endpoints == MAXENDPOINTS || parse_endpoint(&b->endpoints[b->num_endpoints], endpoint) == -1) {
+                    fprintf(stderr, "%s:%d: malformed endpoint, or more than %d\n", source, line_no, MAXENDPOINTS);
+                    return -1;
+                }
+                b->num_endpoints++;
+            }
+            if (b->num_endpoints == 0) {
+                fprintf(stderr, "%s:%d: backend %s has no endpoints\n", source, line_no, name);
+                return -1;
+            }
+            build_ring(b);
+        }
+        else if (strcmp(directive, "route") == 0 || strcmp(directive, "auth") == 0) {
+            char* target = directive[0] == 'a' ? name : strtok_r(NULL, " \t\r", &save);
+            struct backend* b = target != NULL ? find_backend(r, target) : NULL;
+            if (b == NULL) {
+                fprintf(stderr, "%s:%d: unknown backend\n", source, line_no);
+                return -1;
+            }
+            if (directive[0] == 'a') {
+                r->auth = b;
+                continue;
+            }
+            if (r->num_routes == MAXROUTES) {
+                fprintf(stderr, "%s:%d: more than %d routes\n", source, line_no, MAXROUTES);
+                return -1;
+            }
+            struct route* route = &r->routes[r->num_routes++];
+            strcpy(route->prefix, name);
+            route->prefix_len = strlen(name);
+            route->b = b;
+        }
+        else {
+            fprintf(stderr, "%s:%d: unknown directive %s\n", source, line_no, directive);
+            return -1;
+        }
+    }
+    if (r->auth == NULL) {
+        fprintf(stderr, "%s: no auth backend\n", source);
+        return -1;
+    }
+    return 0;
+}
+
+// read_routing_file reads the routing table from the file at path. Returns -1 on
+// failure.
+int read_routing_file(struct routing* r, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    long size;
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 || fseek(fp, 0, SEEK_SET) == -1) {
+        perror(path);
+        fclose(fp);
+        return -1;
+    }
+    char* text = malloc(size + 1);
+    if (text == NULL || fread(text, 1, size, fp) != size) {
+        perror(path);
+        free(text);
+        fclose(fp);
+        return -1;
+    }
+    text[size] = '\0';
+    fclose(fp);
+    int rv = parse_routing(r, text, path);
+    free(text);
+    return rv;
+}
+
+// route_course returns the backend serving course, by the longest route prefix
+// it starts with, or NULL if no route matches
+struct backend* route_course(struct routing* r, const char* course)
+{
+    struct route* best = NULL;
+    for (int i = 0; i < r->num_routes; i++) {
+        struct route* route = &r->routes[i];
+        if (strncmp(course, route->prefix, route->prefix_len) == 0
+                && (best == NULL || route->prefix_len > best->prefix_len))
+            best = route;
+    }
+    return best != NULL ? best->b : NULL;
+}
+
+// pick_endpoint returns the endpoint of b to send key to. Walking the ring from
+// the hash of key, the first two healthy endpoints are the candidates, and the
+// one with fewer outstanding requests wins (the power of two choices), the first
+// on a tie so a key keeps going to the same endpoint while the load is even. If
+// every endpoint is ejected, the first one on the ring is used anyway.
+int pick_endpoint(const struct backend* b, const char* key)
+{
+    uint32_t hash = hash_str(key);
+    int lo = 0, hi = b->ring_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (b->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int owner = b->ring[lo % b->ring_len].endpoint;
+    int first = -1;
+    for (int i = 0; i < b->ring_len; i++) {
+        int e = b->ring[(lo + i) % b->ring_len].endpoint;
+        if (!b->endpoints[e].healthy || e == first)
+            continue;
+        if (first == -1) {
+            first = e;
+            continue;
+        }
+        return b->endpoints[e].outstanding < b->endpoints[first].outstanding ? e : first;
+    }
+    return first != -1 ? first : owner;
+}
+
+// pick_other_endpoint returns the healthy endpoint of b other than exclude with
+// the fewest outstanding requests, for sending a request again after exclude did
+// not answer; exclude itself if there is no other
+int pick_other_endpoint(const struct backend* b, int exclude)
+{
+    int best = exclude;
+    for (int e = 0; e < b->num_endpoints; e++) {
+        if (e == exclude || !b->endpoints[e].healthy)
+            continue;
+        if (best == exclude || b->endpoints[e].outstanding < b->endpoints[best].outstanding)
+            best = e;
+    }
+    return best;
+}
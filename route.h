@@ -0,0 +1,75 @@
+// route.h declares the routing table serverM uses to pick the server C/CS/EE
+// instance a request goes to
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netdb.h>
+
+#include "hist.h"
+
+#define MAXBACKENDS 16
+#define MAXENDPOINTS 16  // instances per backend
+#define MAXROUTES 64
+#define MAXNAMELEN 32
+#define RING_POINTS 64  // points per endpoint on the consistent hashing ring
+#define EJECT_PROBES 3  // failed health probes in a row that take an endpoint out of use
+
+// endpoint is one server instance
+struct endpoint {
+    char host[64];
+    char port[8];
+    struct addrinfo* addr;  // resolved by serverM after parsing
+    int outstanding;  // requests sent to it and not answered yet, health probes aside
+    bool healthy;  // false while ejected for failing health probes
+    int failed_probes;  // in a row
+    bool probing;  // a health probe is pending
+};
+
+// ring_point is one point of a consistent hashing ring: the keys hashing to
+// just below it go to its endpoint
+struct ring_point {
+    uint32_t hash;
+    int endpoint;
+};
+
+// backend is a named group of server instances serving the same data. Each key
+// is sent to one of them, picked by consistent hashing, so a backend can be
+// split over more instances while moving only the keys of the new one. The
+// instances are replicas of each other, so a key may also go to the next one on
+// the ring when its own is busier or ejected.
+struct backend {
+    char name[MAXNAMELEN];  // e.g. "serverCS", used in log lines
+    struct endpoint endpoints[MAXENDPOINTS];
+    int num_endpoints;
+    struct ring_point ring[MAXENDPOINTS * RING_POINTS];  // sorted by hash
+    int ring_len;
+    struct hist latency;  // microseconds from a request to its response, retries included
+    unsigned long retries;  // requests sent again after a timeout
+    unsigned long failures;  // requests given up on after the last retry
+};
+
+// route sends the course codes starting with prefix to a backend
+struct route {
+    char prefix[MAXNAMELEN];
+    int prefix_len;
+    struct backend* b;
+};
+
+// routing is the whole routing table
+struct routing {
+    struct backend backends[MAXBACKENDS];
+    int num_backends;
+    struct route routes[MAXROUTES];
+    int num_routes;
+    struct backend* auth;  // where authentication requests go
+};
+
+int parse_routing(struct routing* r, char text[], const char* source);
+int read_routing_file(struct routing* r, const char* path);
+struct backend* route_course(struct routing* r, const char* course);
+int pick_endpoint(const struct backend* b, const char* key);
+int pick_other_endpoint(const struct backend* b, int exclude);
+
+#endif
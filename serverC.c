@@ -9,195 +9,124 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
+#include <stdint.h>
 
+#include "table.h"
+#include "udp_server.h"
+#include "protocol.h"
+#include "log.h"
 
-#define PORT "21893"
-#define MAXBUFLEN 100
 
+#define PORT "21893"
 
-char** cred_txt_content;  // store credentials data
-int len_cred_txt_content;  // number of lines of credentials file
 
+// fields of a credentials line, in file order
+enum cred_field {
+    FIELD_USERNAME,
+    FIELD_PASSWORD,
+    NUM_FIELDS
+};
 
-// get_in_addr function was taken from Beej's Guide to Network Programming
-// (6.3 Datagram Sockets)
-void *get_in_addr(struct sockaddr *sa)
-{
-    if (sa->sa_family == AF_INET) {
-        return &(((struct sockaddr_in*)sa)->sin_addr);
-    }
-    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+// read_and_store_cred_txt loads cred.txt which it assumes
+// is located in the same directory as the serverC executable file,
+// and stores the content in memory: the file is mapped and indexed in place by
+// username, or if "./snapshot cred.txt cred.snap 2" compiled it into a snapshot
+// since it last changed, the snapshot is mapped and used as is. It is called
+// again whenever either file changes.
+struct table* read_and_store_cred_txt() {
+    return load_table("cred.txt", "cred.snap", NUM_FIELDS);
 }
 
-// start_udp_server function was heavily inspired by Beej's Guide to Network Programming
-// (6.3 Datagram Sockets, listener.c)
-int start_udp_server()
+// check_cred looks up the username of a "username,password" pair in the
+// credentials table and compares the password to the stored one; returns 2 on
+// success, 1 for a wrong password and 0 for a wrong username
+int check_cred(const struct table* cred_table, char username_password[])
 {
-    int sockfd;
-    struct addrinfo hints, *servinfo, *p;
-    int rv;
-    char s[INET6_ADDRSTRLEN];
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET6;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = AI_PASSIVE;
-
-    if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
-    }
-
-    // assign socket and return descriptor
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            perror("listener: socket");
-            continue;
-        }
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            perror("listener: bind");
-            continue;
-        }
-        break;
-    }
-
-    if (p == NULL) {
-        fprintf(stderr, "listener: failed to bind socket\n");
-        return 2;
-    }
-
-    freeaddrinfo(servinfo);
-    return sockfd;
+    char* username = username_password;
+    char* password = strchr(username_password, ',');
+    if (password != NULL)
+        *password++ = '\0';
+    else
+        password = "";
+
+    uint32_t row = find_row(cred_table, view_of(username));
+    if (row == 0)
+        return 0; // wrong username
+    if (view_equals(view_of(password), table_field(cred_table, row - 1, FIELD_PASSWORD)))
+        return 2; // success
+    return 1; // wrong password
 }
 
-// read_and_store_cred_txt reads cred.txt which it assumes
-// is located in the same directory as the serverC executable file,
-// and stores the content in memory.
-void read_and_store_cred_txt() {
-    FILE * fp;
-    char * line = NULL;
-    size_t len = 0;
-    ssize_t read;
-
-    // get number of lines in the file
-    int num_lines = 0;
-    fp = fopen("cred.txt", "r");
-    if (fp == NULL)
-        exit(EXIT_FAILURE);
-    while ((read = getline(&line, &len, fp)) != -1)
-        num_lines++;
-    fclose(fp);
-
-    len_cred_txt_content = num_lines;
-    
-    // allocate memory to the credentials storage data structure
-    cred_txt_content = malloc(num_lines * sizeof(char*));
-    for (int i = 0; i < num_lines; i++)
-        cred_txt_content[i] = malloc((MAXBUFLEN + 1) * sizeof(char));
-
-    // store cred.txt data in local data structure
-    fp = fopen("cred.txt", "r");
-    if (fp == NULL)
-        exit(EXIT_FAILURE);
-    int line_idx = 0;
-    while ((read = getline(&line, &len, fp)) != -1) {
-        strcpy(cred_txt_content[line_idx], line);
-        line_idx++;
-        // if (line)
-        //     free(line);
+// check_cred_batch checks each pair of a batch authentication request and packs
+// the results over the start of the request: the mark alone is longer than the
+// results of the first 8 pairs, and each further pair takes at least one byte
+// while its result takes a quarter of one, so no result overwrites a pair that
+// has not been read yet
+struct str_view check_cred_batch(const struct table* cred_table, char request[])
+{
+    char* results = request;
+    char* rest = request + BATCH_AUTH_MARK_LEN;
+    int num_pairs = 0;
+    while (*rest != '\0') {
+        char* pair = rest;
+        rest += strcspn(rest, "\n");
+        if (*rest != '\0')
+            *rest++ = '\0';
+        int result = check_cred(cred_table, pair);
+        if (num_pairs % 4 == 0)
+            results[num_pairs / 4] = 0;
+        results[num_pairs / 4] |= result << (num_pairs % 4 * 2);
+        num_pairs++;
     }
-    fclose(fp);
+    log_info("The ServerC received a batch of %d authentication requests.\n", num_pairs);
+    if (num_pairs == 0)
+        return view_of(BATCH_AUTH_EMPTY);
+    return (struct str_view){ results, (num_pairs + 3) / 4 };
 }
 
-// check_creds loops through the locally stored credentials, and compares the
-// specified username and password to the stored data; returning a success/failure
-// code to the client
-char* check_creds(char username_password[])
+// check_creds answers an authentication request, a single "username,password"
+// pair or a batch of them, with a success/failure code to the client
+struct str_view check_creds(const struct table* cred_table, char request[])
 {
-    int code;
-    char* token;
-
-    token = strtok(username_password, ",");
-    char username[MAXBUFLEN];
-    strcpy(username, token);
-    token = strtok(NULL, ",");
-    char password[MAXBUFLEN];
-    strcpy(password, token);
-
-    // loop through stored credentials data to compare with request
-    char line[MAXBUFLEN];
-    for (int i = 0; i < len_cred_txt_content; i++) {
-        strcpy(line, cred_txt_content[i]);
-        char* token = strtok(line, ",");
-        token[strcspn(token, "\t\r\n\v\f")] = 0;
-        if (strcmp(username, token) == 0) {
-            token = strtok(NULL, ",");
-            token[strcspn(token, "\t\r\n\v\f")] = 0;
-            int result = strcmp(password, token);
-            if (result == 0)
-                return "2"; // success
-            else
-                return "1"; // wrong password
-        }
-    }
-    return "0"; // wrong username
+    if (strncmp(request, BATCH_AUTH_MARK, BATCH_AUTH_MARK_LEN) == 0)
+        return check_cred_batch(cred_table, request);
+    log_info("The ServerC received an authentication request from the Main Server.\n");
+    static const char* codes[] = { "0", "1", "2" };
+    return view_of(codes[check_cred(cred_table, request)]);
 }
 
-// udp_recv_and_respond receives a request from the client over UDP and
-// responds to the client accordingly
-void udp_recv_and_respond(int sockfd,
-                          struct sockaddr_storage their_addr,
-                          socklen_t addr_len,
-                          char buf[])
+int main(int argc, char *argv[])
 {
-    addr_len = sizeof their_addr;
-    int numbytes;
-    if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN - 1, 0,
-                             (struct sockaddr *)&their_addr, &addr_len)) == -1){
-        perror("recvfrom");
+    struct udp_server srv;
+    srv.name = "ServerC";
+    srv.handler = check_creds;
+    srv.loader = read_and_store_cred_txt;
+    srv.watched_files[0] = "cred.txt";
+    srv.watched_files[1] = "cred.snap";
+    srv.port = PORT;
+    parse_server_options(&srv, argc, argv);
+    if (log_start() == -1)
         exit(1);
-    }
-    buf[numbytes] = '\0';
-
-    // check the received credentials
-    printf("The ServerC received an authentication request from the Main Server.\n");
-    char* resp = check_creds(buf);
-
-    // send response to serverM (success/failure code)
-    if ((numbytes = sendto(sockfd, resp, strlen(resp), 0, (struct sockaddr *)&their_addr, addr_len)) == -1) {
-        perror("senderr: sendto");
+    // start UDP listeners, one per worker thread
+    if (start_udp_server(&srv) == -1)
         exit(1);
-    }
-    printf("The ServerC finished sending the response to the Main Server.\n");
-}
-
-int main(void)
-{
-    int numbytes;
-    struct sockaddr_storage their_addr;
-    char buf[MAXBUFLEN];
-    socklen_t addr_len;
-    // start UDP listener
-    int sockfd = start_udp_server();
     // read and store cred.txt data
-    read_and_store_cred_txt();
+    if (load_server_data(&srv) == -1)
+        exit(1);
 
     /*
     // Code to check local credentials data stored:
-    printf("num lines: %d\n", len_cred_txt_content);
-    for (int i = 0; i < len_cred_txt_content; i++) {
-        printf("%s",cred_txt_content[i]);
+    const struct table* cred_table = srv.table;
+    printf("num credentials: %u\n", cred_table->num_keys);
+    for (uint32_t row = 0; row < cred_table->num_rows; row++) {
+        struct str_view username = table_field(cred_table, row, FIELD_USERNAME);
+        struct str_view password = table_field(cred_table, row, FIELD_PASSWORD);
+        printf("%.*s,%.*s\n", username.len, username.ptr, password.len, password.ptr);
     }
     */
 
     // loop to service credential requests
-    printf("The ServerC is up and running using UDP on port %s.\n", PORT);
-    while(1) {
-        udp_recv_and_respond(sockfd, their_addr, addr_len, buf);
-    }
-
-    close(sockfd);
+    log_notice("The ServerC is up and running using UDP on port %s.\n", srv.port);
+    run_udp_server(&srv);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,9 +9,19 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <time.h>
+
+#include "protocol.h"
+#include "cache.h"
+#include "route.h"
+#include "session.h"
+#include "cipher.h"
+#include "metrics.h"
+#include "log.h"
 
 #define PORT "25893"
 #define UDP_PORT "24893"
@@ -19,16 +30,160 @@
 #define SERVEREEPORT "23893"
 
 #define MAXBUFLEN 100
-#define BACKLOG 10
+#define MAXFRAMELEN (FRAME_HDR_LEN + MAXQUERYLEN)  // longest message on the client connection
+#define BACKLOG 128
+#define MAXEVENTS 64
+#define MAXCONNS 16384  // client descriptors are used directly as indices into conns
+#define MAXPENDING 4096  // requests in flight to servers C/CS/EE; must be a power of two
+#define UDP_BATCH 64  // datagrams sent or received per sendmmsg/recvmmsg call
+#define UDP_RCVBUF (MAXPENDING * 2048)  // room for an answer to every request in flight,
+                                        // with the kernel's bookkeeping per datagram
+#define OUT_HIGH_WATER (8 * MAXFRAMELEN)  // stop taking requests while this much output is unsent
+#define CACHE_TTL 60  // default seconds a cached course query answer is served
+#define CACHE_ENTRIES 4096  // default number of cached course query answers
+#define UDP_TIMEOUT_MS 100  // default wait for the first response to a backend request
+#define UDP_RETRIES 3  // default retransmissions, each waiting twice as long as the last
+#define MAXRETRIES 8
+#define SESSION_LIFETIME 3600  // default seconds a session token is valid
+#define PROBE_INTERVAL_MS 1000  // default time between health probes of each backend instance
 
-// sigchld_handler function was taken from Beej's Guide to Network Programming
-// (6.1 A Simple Stream Server)
-void sigchld_handler(int s)
-{
-    int saved_errno = errno;
-    while(waitpid(-1, NULL, WNOHANG) > 0);
-    errno = saved_errno;
-}
+// connection states; each client connection moves through these instead of
+// having a dedicated process block on it
+enum conn_state {
+    CONN_LOGIN,       // waiting for "username,password" from the client
+    CONN_AUTH_WAIT,   // waiting for serverC to answer the authentication request
+    CONN_QUERY        // taking "course,category[;course,category...]" requests, any number
+                      // of which may be outstanding on serverCS/serverEE at once
+};
+
+// query is one query request from a client, answered once serverCS/serverEE have
+// answered every course query in its batch
+struct query {
+    bool in_use;
+    unsigned int seq;  // unique per request, so a reused slot is not mistaken for it
+    uint32_t tag;  // copied from the request into the response
+    int batch_len;  // number of course queries in the batch
+    int batch_outstanding;  // of those, the ones still waiting on a backend
+    uint64_t received_ns;  // when the request was taken, for the query stage metrics
+    char answers[MAXBATCH][MAXANSWERLEN];  // hold the "course,category" request until answered
+};
+
+// conn holds everything the event loop needs to know about one client
+struct conn {
+    int fd;
+    unsigned int id;  // unique per accepted connection, so a reused fd is not mistaken for it
+    enum conn_state state;
+    int remaining_attempts;
+    bool closing;  // close once the pending output has been flushed
+    bool dirty;  // has output queued since the last flush
+    unsigned int events;  // epoll events currently registered
+    char username[MAXBUFLEN];
+    uint32_t login_tag;  // tag of the login request waiting on serverC
+    struct query* queries[MAXINFLIGHT];  // allocated on first use and then reused
+    int num_inflight;  // query requests not answered yet
+    char in[2 * MAXFRAMELEN];  // received bytes not yet parsed into whole messages
+    int in_len;
+    char* out;  // output not yet accepted by the kernel
+    int out_len;
+    int out_cap;
+};
+
+// pending tracks a request sent to a backend until its response arrives. The low
+// bits of req_id are the slot index in pendings and the high bits a sequence
+// number, so a late response for a recycled slot is recognized and dropped.
+// Retransmissions reuse the ID, so a late response to any attempt is accepted.
+struct pending {
+    uint32_t req_id;  // 0 while the slot is free
+    int fd;  // -1 for a health probe, which no connection is waiting on
+    unsigned int conn_id;
+    int query;  // slot of the query request in its connection, or -1 for a login
+    unsigned int query_seq;
+    int item;  // position of the course query within its batch
+    struct backend* b;
+    int endpoint;  // instance of b the request was sent to
+    int attempt;  // 0 for the first transmission
+    uint64_t sent_us;  // time of the first transmission
+    uint64_t deadline_us;  // time the current attempt times out
+    int prev, next;  // neighbours in the timer list of the attempt, -1 at the ends
+    char request[MAXBUFLEN];  // kept for retransmission
+};
+
+// timer_list links the pending requests of one attempt number in the order they
+// were sent. Every request of an attempt waits equally long, so that is also the
+// order of their deadlines and the head of each list is the next to time out.
+struct timer_list {
+    int head, tail;  // -1 when empty
+};
+
+// stages of handling client requests whose latencies serverM records; the round
+// trip to each backend is kept in its own histogram
+enum main_stage {
+    STAGE_RECV,  // receiving what a client sent
+    STAGE_ENCRYPT,  // encrypting a login
+    STAGE_LOOKUP,  // routing a course query and looking it up in the cache
+    STAGE_QUERY,  // a query request, from being taken to its answer being queued
+    STAGE_SEND,  // sending the output of a connection
+    NUM_STAGES
+};
+
+enum main_counter {
+    COUNTER_CONNECTIONS,
+    COUNTER_LOGINS,
+    COUNTER_RESUMES,
+    COUNTER_QUERIES,  // course queries, counting each of a batch
+    COUNTER_CACHE_HITS,
+    NUM_COUNTERS
+};
+
+const char* const stage_names[NUM_STAGES] = { "recv", "encrypt", "lookup", "query", "send" };
+const char* const counter_names[NUM_COUNTERS] = { "connections", "logins", "resumes", "queries", "cache hits" };
+
+// DEFAULT_ROUTING is the routing table used without "-f": a single serverC,
+// serverCS and serverEE, with course codes routed by department
+#define DEFAULT_ROUTING \
+    "backend serverC 127.0.0.1:" SERVERCPORT "\n" \
+    "backend serverCS 127.0.0.1:" SERVERCSPORT "\n" \
+    "backend serverEE 127.0.0.1:" SERVEREEPORT "\n" \
+    "auth serverC\n" \
+    "route CS serverCS\n" \
+    "route EE serverEE\n"
+
+int epfd;  // epoll instance multiplexing the listener, the UDP socket and all clients
+int udp_fd;  // UDP socket shared by every connection to talk to servers C/CS/EE
+struct conn* conns[MAXCONNS];  // live connections indexed by descriptor
+unsigned int next_conn_id = 1;
+unsigned int next_query_seq = 1;
+struct routing routing;  // which instances of servers C/CS/EE serve which requests
+struct pending pendings[MAXPENDING];
+int free_pendings[MAXPENDING];  // stack of free slots in pendings
+int num_free_pendings;
+uint32_t next_req_seq = 1;
+struct timer_list timers[MAXRETRIES + 1];  // pending requests by attempt number
+int udp_timeout_ms = UDP_TIMEOUT_MS;
+int udp_retries = UDP_RETRIES;
+int probe_interval_ms = PROBE_INTERVAL_MS;
+uint64_t next_probe_us;  // time to send the next round of health probes
+int dirty_conns[MAXCONNS];  // descriptors of connections with output to flush
+int num_dirty_conns;
+struct cache query_cache;  // course query answers, shared by all connections
+struct sessions sessions;  // signs and checks session tokens
+struct metrics metrics;  // a single slot, as serverM has a single thread
+int metrics_interval;  // seconds between metrics dumps; 0 dumps only on SIGUSR1
+uint64_t next_metrics_us;  // time of the next periodic metrics dump
+time_t now;  // monotonic seconds, updated once per event loop iteration
+uint64_t now_us;  // the same time in microseconds
+volatile sig_atomic_t invalidate_requested;  // set by SIGHUP to flush query_cache
+volatile sig_atomic_t stats_requested;  // set by SIGUSR1 to print the metrics and backend latencies
+// datagrams to servers C/CS/EE produced in the current event loop iteration; they
+// all go out with one sendmmsg() when it ends
+char udp_out_bufs[UDP_BATCH][UDP_HDR_LEN + MAXBUFLEN];
+struct iovec udp_out_iovs[UDP_BATCH];
+struct mmsghdr udp_out_msgs[UDP_BATCH];
+int num_udp_out;
+// preallocated vectors for draining responses with recvmmsg()
+char udp_in_bufs[UDP_BATCH][UDP_HDR_LEN + MAXANSWERLEN];
+struct iovec udp_in_iovs[UDP_BATCH];
+struct mmsghdr udp_in_msgs[UDP_BATCH];
 
 // get_in_addr function was taken from Beej's Guide to Network Programming
 // (6.1 A Simple Stream Server)
@@ -46,7 +201,6 @@ int start_tcp_server()
 {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
-    struct sigaction sa;
     int yes=1;
     int rv;
 
@@ -90,14 +244,6 @@ int start_tcp_server()
         exit(1);
     }
 
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(1);
-    }
-
     // return descriptor
     return sockfd;
 }
@@ -109,7 +255,6 @@ int start_udp_client()
     int udp_sockfd;
 	struct addrinfo udp_hints, *udp_servinfo, *udp_p;
 	int udp_rv;
-	char udp_s[INET6_ADDRSTRLEN];
 
 	memset(&udp_hints, 0, sizeof udp_hints);
 	udp_hints.ai_family = AF_UNSPEC;
@@ -142,13 +287,20 @@ int start_udp_client()
 
 	freeaddrinfo(udp_servinfo);
 
+    // the default receive buffer holds a few hundred datagrams, fewer than the
+    // answers a burst of requests brings back at once; past the rmem_max sysctl
+    // only a privileged process gets more
+    int rcvbuf = UDP_RCVBUF;
+    if (setsockopt(udp_sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) == -1)
+        setsockopt(udp_sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
     // return descriptor
     return udp_sockfd;
 }
 
 // configure_udp_server function was heavily inspired by Beej's Guide to Network Programming
 // (6.3 Datagram Sockets)
-struct addrinfo* configure_udp_server(char server_port[])
+struct addrinfo* configure_udp_server(char server_host[], char server_port[])
 {
     struct addrinfo udp_hints, *udp_servinfo, *udp_p;
 	int udp_rv;
@@ -157,7 +309,7 @@ struct addrinfo* configure_udp_server(char server_port[])
 	udp_hints.ai_family = AF_UNSPEC;
 	udp_hints.ai_socktype = SOCK_DGRAM;
 
-	if ((udp_rv = getaddrinfo("127.0.0.1", server_port, &udp_hints, &udp_servinfo)) != 0) {
+	if ((udp_rv = getaddrinfo(server_host, server_port, &udp_hints, &udp_servinfo)) != 0) {
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(udp_rv));
 		return NULL;
 	}
@@ -166,197 +318,992 @@ struct addrinfo* configure_udp_server(char server_port[])
     return udp_p;
 }
 
-// recv_str receives string messages through TCP from client and stores it in buf
-void recv_str(int sockfd, char buf[])
+// sighup_handler asks the event loop to invalidate the query cache, e.g. after
+// the course files were updated
+void sighup_handler(int s)
 {
-    int numbytes;
-    if ((numbytes = recv(sockfd, buf, MAXBUFLEN-1, 0)) == -1) {
-        perror("recv");
-        exit(1);
+    invalidate_requested = 1;
+}
+
+// sigusr1_handler asks the event loop to print the metrics and backend latency
+// statistics
+void sigusr1_handler(int s)
+{
+    stats_requested = 1;
+}
+
+// update_now refreshes the event loop's notion of the current time
+void update_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec;
+    now_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// set_nonblocking puts a descriptor in non-blocking mode for the event loop
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
     }
-    buf[numbytes] = '\0';
+    return 0;
 }
 
-// send_str sends string, str, messages through TCP to client
-int send_str(int sockfd, char str[])
+// conn_watch registers interest in input while there is room to buffer it, and in
+// output only while a response is pending
+void conn_watch(struct conn* c)
 {
-    if (send(sockfd, str, strlen(str), 0) == -1)
-        perror("send");
+    struct epoll_event ev;
+    ev.events = 0;
+    if (!c->closing && c->in_len < sizeof c->in)
+        ev.events |= EPOLLIN;
+    if (c->out_len > 0)
+        ev.events |= EPOLLOUT;
+    if (ev.events == c->events)
+        return;
+    ev.data.fd = c->fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        perror("epoll_ctl");
+    c->events = ev.events;
 }
 
-// udp_receive receives string messages from servers C/CS/EE and stores it in buf
-void udp_receive(int sockfd, struct sockaddr_storage their_addr, socklen_t addr_len, char buf[])
+// conn_open starts tracking a newly accepted client connection
+void conn_open(int fd)
 {
-    int numbytes;
-    if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN - 1, 0, (struct sockaddr *)&their_addr, &addr_len)) == -1){
-        perror("recvfrom");
-        exit(1);
+    struct epoll_event ev;
+    if (fd >= MAXCONNS) {
+        fprintf(stderr, "too many connections\n");
+        close(fd);
+        return;
+    }
+    struct conn* c = calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->id = next_conn_id++;
+    c->state = CONN_LOGIN;
+    c->remaining_attempts = 3;
+    metrics_count(metrics.slots, COUNTER_CONNECTIONS, 1);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(fd);
+        free(c);
+        return;
     }
-    buf[numbytes] = '\0';
+    c->events = ev.events;
+    conns[fd] = c;
 }
 
-// udp_send sends string messages, str, to servers C/CS/EE
-void udp_send(int udp_sockfd, struct addrinfo* udp_p, char str[])
+// conn_close stops tracking a connection; responses to requests it still has
+// pending on a backend are discarded when they arrive
+void conn_close(struct conn* c)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    for (int i = 0; i < MAXINFLIGHT; i++)
+        free(c->queries[i]);
+    free(c->out);
+    free(c);
+}
+
+// conn_flush writes as much pending output as the socket accepts. Returns -1 if
+// the connection was closed as a result.
+int conn_flush(struct conn* c)
 {
     int numbytes;
-    if ((numbytes = sendto(udp_sockfd, str, strlen(str), 0, udp_p->ai_addr, udp_p->ai_addrlen)) == -1) {
-        perror("talker: sendto");
-        exit(1);
+    int sent = 0;
+    uint64_t start = metrics_now_ns();
+    while (sent < c->out_len) {
+        numbytes = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (numbytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("send");
+            conn_close(c);
+            return -1;
+        }
+        sent += numbytes;
+    }
+    metrics_record(metrics.slots, STAGE_SEND, metrics_now_ns() - start);
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    if (c->out_len == 0 && c->closing) {
+        conn_close(c);
+        return -1;
     }
+    conn_watch(c);
+    return 0;
 }
 
-// encrypt_char encrypts an individual character by shifting the character by 4
-char encrypt_char(char ch)
+// mark_dirty schedules c to be flushed at the end of the current event loop
+// iteration, so responses produced for it in the same iteration share one send()
+void mark_dirty(struct conn* c)
 {
-    // capital letters
-    if (ch >= 65 && ch <= 90) {
-        ch += 4;
-        if (ch > 90) {
-            int diff = ch - 91;
-            ch = 65 + diff;
+    if (!c->dirty) {
+        c->dirty = true;
+        dirty_conns[num_dirty_conns++] = c->fd;
+    }
+}
+
+// flush_dirty flushes every connection marked dirty
+void flush_dirty()
+{
+    for (int i = 0; i < num_dirty_conns; i++) {
+        struct conn* c = conns[dirty_conns[i]];
+        if (c == NULL || !c->dirty)
+            continue;
+        c->dirty = false;
+        conn_flush(c);
+    }
+    num_dirty_conns = 0;
+}
+
+// send_msg queues a message of the given type and tag carrying string str to the
+// client; it is sent when the connection is next flushed. The output buffer grows
+// as needed: process_input stops taking requests past OUT_HIGH_WATER, which bounds
+// it. Returns -1 if the connection was closed as a result.
+int send_msg(struct conn* c, uint8_t type, uint32_t tag, char str[])
+{
+    int len = strlen(str);
+    if (c->out_len + FRAME_HDR_LEN + len > c->out_cap) {
+        int cap = c->out_cap > 0 ? c->out_cap : 2 * MAXFRAMELEN;
+        while (cap < c->out_len + FRAME_HDR_LEN + len)
+            cap *= 2;
+        char* out = realloc(c->out, cap);
+        if (out == NULL) {
+            perror("realloc");
+            conn_close(c);
+            return -1;
         }
+        c->out = out;
+        c->out_cap = cap;
     }
-    // lowercase letters
-    else if (ch >= 97 && ch <= 122) {
-        ch += 4;
-        if (ch > 122) {
-            int diff = ch - 123;
-            ch = 97 + diff;
+    frame_put_header(c->out + c->out_len, type, tag, len);
+    memcpy(c->out + c->out_len + FRAME_HDR_LEN, str, len);
+    c->out_len += FRAME_HDR_LEN + len;
+    mark_dirty(c);
+    return 0;
+}
+
+// fill_input receives as many bytes from the client as are available and fit in
+// its input buffer. Returns -1 if the client disconnected, in which case the
+// connection has been closed.
+int fill_input(struct conn* c)
+{
+    int numbytes;
+    uint64_t start = metrics_now_ns();
+    while (c->in_len < sizeof c->in) {
+        numbytes = recv(c->fd, c->in + c->in_len, sizeof c->in - c->in_len, 0);
+        if (numbytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            perror("recv");
+            conn_close(c);
+            return -1;
         }
+        if (numbytes == 0) {
+            conn_close(c);
+            return -1;
+        }
+        c->in_len += numbytes;
     }
-    // digits
-    else if (ch >= 48 && ch <= 57) {
-        ch += 4;
-        if (ch > 57) {
-            int diff = ch - 58;
-            ch = 48 + diff;
+    metrics_record(metrics.slots, STAGE_RECV, metrics_now_ns() - start);
+    return 0;
+}
+
+// flush_udp sends every queued datagram to servers C/CS/EE with as few sendmmsg()
+// calls as possible. A datagram the kernel refuses is dropped.
+void flush_udp()
+{
+    int sent = 0;
+    while (sent < num_udp_out) {
+        int n = sendmmsg(udp_fd, udp_out_msgs + sent, num_udp_out - sent, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("talker: sendmmsg");
+            n = 1;
         }
+        sent += n;
     }
-    return ch;
+    num_udp_out = 0;
+}
+
+// udp_send queues string messages, str, to servers C/CS/EE tagged with req_id; they
+// are sent by the next flush_udp()
+void udp_send(struct addrinfo* udp_p, uint32_t req_id, char str[])
+{
+    if (num_udp_out == UDP_BATCH)
+        flush_udp();
+    char* datagram = udp_out_bufs[num_udp_out];
+    int len = strlen(str);
+    udp_put_req_id(datagram, req_id);
+    memcpy(datagram + UDP_HDR_LEN, str, len);
+    struct mmsghdr* msg = &udp_out_msgs[num_udp_out];
+    memset(msg, 0, sizeof *msg);
+    udp_out_iovs[num_udp_out].iov_base = datagram;
+    udp_out_iovs[num_udp_out].iov_len = UDP_HDR_LEN + len;
+    msg->msg_hdr.msg_iov = &udp_out_iovs[num_udp_out];
+    msg->msg_hdr.msg_iovlen = 1;
+    msg->msg_hdr.msg_name = udp_p->ai_addr;
+    msg->msg_hdr.msg_namelen = udp_p->ai_addrlen;
+    num_udp_out++;
 }
 
-// encrypt encrypts a string by shifting each character by 4
-void encrypt(char str[])
+// init_pendings marks every slot of the pending request table free
+void init_pendings()
 {
-    for (int i = 0; i < strlen(str); i++) {
-        str[i] = encrypt_char(str[i]);
+    for (int i = 0; i < MAXPENDING; i++)
+        free_pendings[i] = MAXPENDING - 1 - i;
+    num_free_pendings = MAXPENDING;
+    for (int i = 0; i <= MAXRETRIES; i++)
+        timers[i].head = timers[i].tail = -1;
+}
+
+// timer_add starts the timeout of the current attempt of pending request slot
+void timer_add(int slot)
+{
+    struct pending* p = &pendings[slot];
+    struct timer_list* list = &timers[p->attempt];
+    p->deadline_us = now_us + ((uint64_t)udp_timeout_ms * 1000 << p->attempt);
+    p->prev = list->tail;
+    p->next = -1;
+    if (list->tail != -1)
+        pendings[list->tail].next = slot;
+    else
+        list->head = slot;
+    list->tail = slot;
+}
+
+// timer_remove stops the timeout of pending request slot
+void timer_remove(int slot)
+{
+    struct pending* p = &pendings[slot];
+    struct timer_list* list = &timers[p->attempt];
+    if (p->prev != -1)
+        pendings[p->prev].next = p->next;
+    else
+        list->head = p->next;
+    if (p->next != -1)
+        pendings[p->next].prev = p->prev;
+    else
+        list->tail = p->prev;
+}
+
+// alloc_pending takes a free pending request slot, with a fresh request ID, and
+// starts the timeout of its first attempt to endpoint of b. Returns -1 if every
+// slot is in use.
+int alloc_pending(struct backend* b, int endpoint)
+{
+    if (num_free_pendings == 0)
+        return -1;
+    int slot = free_pendings[--num_free_pendings];
+    uint32_t req_id = (next_req_seq++ * MAXPENDING) | slot;
+    // 0 marks a free slot, so never hand it out as an ID
+    if (req_id == 0)
+        req_id = (next_req_seq++ * MAXPENDING) | slot;
+    struct pending* p = &pendings[slot];
+    p->req_id = req_id;
+    p->b = b;
+    p->endpoint = endpoint;
+    p->attempt = 0;
+    p->sent_us = now_us;
+    timer_add(slot);
+    return slot;
+}
+
+// release_pending frees pending request slot
+void release_pending(int slot)
+{
+    struct pending* p = &pendings[slot];
+    timer_remove(slot);
+    // health probes are kept out of the load the instances are compared by
+    if (p->fd != -1)
+        p->b->endpoints[p->endpoint].outstanding--;
+    p->req_id = 0;
+    free_pendings[num_free_pendings++] = slot;
+}
+
+// next_timeout returns the milliseconds until the earliest pending request times
+// out or the next health probes are due, for epoll_wait(), or -1 if neither
+int next_timeout()
+{
+    int timeout = -1;
+    for (int i = 0; i <= udp_retries; i++) {
+        if (timers[i].head == -1)
+            continue;
+        uint64_t deadline_us = pendings[timers[i].head].deadline_us;
+        int ms = deadline_us <= now_us ? 0 : (deadline_us - now_us + 999) / 1000;
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
+    }
+    if (probe_interval_ms > 0) {
+        int ms = next_probe_us <= now_us ? 0 : (next_probe_us - now_us + 999) / 1000;
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
+    }
+    if (metrics_interval > 0) {
+        int ms = next_metrics_us <= now_us ? 0 : (next_metrics_us - now_us + 999) / 1000;
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
     }
+    return timeout;
 }
 
-int main(void)
+// backend_request sends str to the instance of backend b that key belongs to, and
+// records that item of query request slot query of c (-1 for its login) is waiting
+// for the response. Returns -1 if the connection was closed as a result.
+int backend_request(struct backend* b, const char* key, struct conn* c, int query, int item, char str[])
 {
-    int new_fd;
-    socklen_t sin_size;
-    struct sockaddr_storage their_addr;
-    socklen_t sin_size_server;
-    struct sockaddr_storage their_addr_server;
-    char s[INET6_ADDRSTRLEN];
-    bool client_connected = false;
-    bool client_authenticated = false;
+    int endpoint = pick_endpoint(b, key);
+    int slot = alloc_pending(b, endpoint);
+    if (slot == -1) {
+        fprintf(stderr, "too many pending backend requests\n");
+        conn_close(c);
+        return -1;
+    }
+    struct pending* p = &pendings[slot];
+    b->endpoints[endpoint].outstanding++;
+    p->fd = c->fd;
+    p->conn_id = c->id;
+    p->query = query;
+    p->query_seq = query >= 0 ? c->queries[query]->seq : 0;
+    p->item = item;
+    snprintf(p->request, sizeof p->request, "%s", str);
+    udp_send(b->endpoints[endpoint].addr, p->req_id, str);
+    return 0;
+}
 
-    // initialize TCP server and UDP client
-    int sockfd = start_tcp_server();
-    int udp_fd = start_udp_client();
-    struct addrinfo* udp_C_p = configure_udp_server(SERVERCPORT);
-    struct addrinfo* udp_EE_p = configure_udp_server(SERVEREEPORT);
-    struct addrinfo* udp_CS_p = configure_udp_server(SERVERCSPORT);
+// send_probes sends a health probe, an empty request, to every backend instance
+// that has none pending, once every probe_interval_ms
+void send_probes()
+{
+    if (probe_interval_ms == 0 || now_us < next_probe_us)
+        return;
+    next_probe_us = now_us + (uint64_t)probe_interval_ms * 1000;
+    for (int i = 0; i < routing.num_backends; i++) {
+        struct backend* b = &routing.backends[i];
+        for (int e = 0; e < b->num_endpoints; e++) {
+            int slot;
+            if (b->endpoints[e].probing || (slot = alloc_pending(b, e)) == -1)
+                continue;
+            pendings[slot].fd = -1;
+            pendings[slot].request[0] = '\0';
+            b->endpoints[e].probing = true;
+            udp_send(b->endpoints[e].addr, pendings[slot].req_id, "");
+        }
+    }
+}
+
+// handle_probe_result takes an instance out of use once it has failed EJECT_PROBES
+// health probes in a row, and puts it back as soon as it answers one
+void handle_probe_result(struct backend* b, int endpoint, bool answered)
+{
+    struct endpoint* e = &b->endpoints[endpoint];
+    e->probing = false;
+    if (answered) {
+        e->failed_probes = 0;
+        if (!e->healthy) {
+            e->healthy = true;
+            log_notice("The main server put %s at %s:%s back in use.\n", b->name, e->host, e->port);
+        }
+    }
+    else if (++e->failed_probes >= EJECT_PROBES && e->healthy) {
+        e->healthy = false;
+        log_notice("The main server took %s at %s:%s out of use after %d failed health probes.\n", b->name, e->host, e->port, EJECT_PROBES);
+    }
+}
 
+// handle_login processes a "username,password" request from a client. Returns -1
+// if the connection was closed as a result.
+int handle_login(struct conn* c, uint32_t tag, char buf[])
+{
     char buf_username_password[MAXBUFLEN];
-    char buf_username_password_copy[MAXBUFLEN];
-    char buf_course_category[MAXBUFLEN];
-    char buf_course_category_copy[MAXBUFLEN];
-    char buf_department[3];
-    char buf_response[MAXBUFLEN];
-
-    printf("The main server is up and running.\n");
-    // loop to service client requests
-    while(1) {
-        // this block is from Beej's Guide to Network Programming (6.1 A Simple Stream Server)
+    // a login is one pair; serverC would read several lines as a batch of them
+    if (strchr(buf, '\n') != NULL || strncmp(buf, BATCH_AUTH_MARK, BATCH_AUTH_MARK_LEN) == 0) {
+        fprintf(stderr, "malformed login from client\n");
+        conn_close(c);
+        return -1;
+    }
+    snprintf(buf_username_password, sizeof buf_username_password, "%s", buf);
+    char* username = strtok(buf, ",");
+    if (username == NULL) {
+        conn_close(c);
+        return -1;
+    }
+    c->remaining_attempts--;
+    snprintf(c->username, sizeof c->username, "%s", username);
+    log_info("The main server received the authentication for %s using TCP over port %s.\n", username, PORT);
+    uint64_t start = metrics_now_ns();
+    encrypt(buf_username_password, strlen(buf_username_password));
+    metrics_record(metrics.slots, STAGE_ENCRYPT, metrics_now_ns() - start);
+    metrics_count(metrics.slots, COUNTER_LOGINS, 1);
+    // send encrypted login request to serverC
+    if (backend_request(routing.auth, username, c, -1, 0, buf_username_password) == -1)
+        return -1;
+    log_info("The main server sent an authentication request to serverC.\n");
+    c->state = CONN_AUTH_WAIT;
+    c->login_tag = tag;
+    return 0;
+}
+
+// handle_resume processes a session token sent in place of a login. A valid token
+// authenticates the connection right away, without asking serverC; an invalid or
+// expired one is refused without using up a login attempt. Returns -1 if the
+// connection was closed as a result.
+int handle_resume(struct conn* c, uint32_t tag, char buf[])
+{
+    if (session_verify(&sessions, buf, time(NULL), c->username, sizeof c->username) == -1) {
+        log_info("The main server refused an invalid session token.\n");
+        return send_msg(c, MSG_LOGIN_RESULT, tag, "Invalid");
+    }
+    log_info("The main server accepted the session token of %s.\n", c->username);
+    metrics_count(metrics.slots, COUNTER_RESUMES, 1);
+    c->state = CONN_QUERY;
+    return send_msg(c, MSG_LOGIN_RESULT, tag, "2");
+}
+
+// send_answers sends the answers to query request slot q of c to the client, one
+// per line in the order they were asked, and frees the slot. Returns -1 if the
+// connection was closed as a result.
+int send_answers(struct conn* c, int q)
+{
+    struct query* query = c->queries[q];
+    char buf_response[MAXRESPONSELEN];
+    int len = 0;
+    for (int i = 0; i < query->batch_len; i++) {
+        if (i > 0)
+            buf_response[len++] = '\n';
+        int answer_len = strlen(query->answers[i]);
+        memcpy(buf_response + len, query->answers[i], answer_len);
+        len += answer_len;
+    }
+    buf_response[len] = '\0';
+    query->in_use = false;
+    c->num_inflight--;
+    metrics_record(metrics.slots, STAGE_QUERY, metrics_now_ns() - query->received_ns);
+    if (send_msg(c, MSG_QUERY_RESULT, query->tag, buf_response) == -1)
+        return -1;
+    log_info("The main server sent the query information to the client.\n");
+    return 0;
+}
+
+// handle_query processes a "course,category" request from an authenticated client,
+// or a batch of them separated by ';'. The queries of a batch are all sent to
+// serverCS/serverEE at once and answered together once every response is in; the
+// client may send further requests in the meantime. Returns -1 if the connection
+// was closed as a result.
+int handle_query(struct conn* c, uint32_t tag, char buf[])
+{
+    char buf_course_category[MAXPAIRLEN];
+    char* queries[MAXBATCH];
+    int batch_len = 0;
+    struct backend* b;
+
+    for (char* course_category = strtok(buf, ";"); course_category != NULL; course_category = strtok(NULL, ";")) {
+        // a batch is answered whole or not at all, so the client never misses answers
+        if (batch_len == MAXBATCH) {
+            log_info("The main server rejected a request of more than %d queries.\n", MAXBATCH);
+            return send_msg(c, MSG_QUERY_RESULT, tag, TOO_MANY_QUERIES);
+        }
+        queries[batch_len++] = course_category;
+    }
+    // a request of only separators still gets an answer
+    if (batch_len == 0)
+        queries[batch_len++] = "";
+
+    // process_input only calls this while a slot is free
+    int q = 0;
+    while (c->queries[q] != NULL && c->queries[q]->in_use)
+        q++;
+    if (c->queries[q] == NULL && (c->queries[q] = malloc(sizeof(struct query))) == NULL) {
+        perror("malloc");
+        conn_close(c);
+        return -1;
+    }
+    struct query* query = c->queries[q];
+    query->in_use = true;
+    query->seq = next_query_seq++;
+    query->tag = tag;
+    query->received_ns = metrics_now_ns();
+    c->num_inflight++;
+
+    query->batch_len = batch_len;
+    query->batch_outstanding = 0;
+
+    for (int i = 0; i < query->batch_len; i++) {
+        // a pair cut short would be looked up, and cached, as another query
+        if (strlen(queries[i]) >= MAXPAIRLEN) {
+            log_info("The main server rejected a query longer than %d bytes.\n", MAXPAIRLEN - 1);
+            strcpy(query->answers[i], TOO_LONG_QUERY);
+            continue;
+        }
+        snprintf(buf_course_category, sizeof buf_course_category, "%s", queries[i]);
+        char* course = queries[i];
+        char* category = strchr(course, ',');
+        if (category != NULL)
+            *category++ = '\0';
+        else
+            category = "";
+        log_info("The main server received from %s to query course %s about %s using TCP over port %s.\n", c->username, course, category, PORT);
+        metrics_count(metrics.slots, COUNTER_QUERIES, 1);
+        uint64_t start = metrics_now_ns();
+        // determine the department server the request should be sent to
+        b = route_course(&routing, course);
+        const char* cached = b != NULL ? cache_get(&query_cache, buf_course_category, now) : NULL;
+        metrics_record(metrics.slots, STAGE_LOOKUP, metrics_now_ns() - start);
+        // if no department server serves the course, answer with the failure code
+        if (b == NULL) {
+            log_info("The main server received request with invalid department.\n");
+            strcpy(query->answers[i], "None");
+            continue;
+        }
+        if (cached != NULL) {
+            metrics_count(metrics.slots, COUNTER_CACHE_HITS, 1);
+            log_info("The main server found the answer in its cache.\n");
+            strcpy(query->answers[i], cached);
+            continue;
+        }
+        // the answer slot keeps the request so the response can be cached under it
+        strcpy(query->answers[i], buf_course_category);
+        if (backend_request(b, course, c, q, i, buf_course_category) == -1)
+            return -1;
+        log_info("The main server sent a request to %s.\n", b->name);
+        query->batch_outstanding++;
+    }
+    if (query->batch_outstanding == 0)
+        return send_answers(c, q);
+    return 0;
+}
+
+// process_input handles the complete messages buffered for a client, in order.
+// A login is handled only once the previous one has been answered; query requests
+// are handled as long as the client has fewer than MAXINFLIGHT of them outstanding
+// and is keeping up with reading the responses. Returns -1 if the connection was
+// closed as a result.
+int process_input(struct conn* c)
+{
+    char buf[MAXQUERYLEN + 1];
+    uint8_t type;
+    uint32_t tag;
+    uint32_t len;
+    int consumed = 0;
+    int rv = 0;
+
+    while (!c->closing && c->state != CONN_AUTH_WAIT && c->num_inflight < MAXINFLIGHT
+           && c->out_len < OUT_HIGH_WATER) {
+        int frame_len = frame_parse(c->in + consumed, c->in_len - consumed, MAXQUERYLEN, &type, &tag, &len);
+        if (frame_len == 0)
+            break;
+        // a message that cannot be right means the stream is out of sync
+        bool expected = c->state == CONN_LOGIN ? type == MSG_LOGIN || type == MSG_RESUME : type == MSG_QUERY;
+        if (frame_len == -1 || !expected) {
+            fprintf(stderr, "malformed message from client\n");
+            conn_close(c);
+            return -1;
+        }
+        memcpy(buf, c->in + consumed + FRAME_HDR_LEN, len);
+        buf[len] = '\0';
+        consumed += frame_len;
+        if (c->state == CONN_LOGIN)
+            rv = type == MSG_LOGIN ? handle_login(c, tag, buf) : handle_resume(c, tag, buf);
+        else
+            rv = handle_query(c, tag, buf);
+        if (rv == -1)
+            return -1;
+    }
+    memmove(c->in, c->in + consumed, c->in_len - consumed);
+    c->in_len -= consumed;
+    mark_dirty(c);
+    return 0;
+}
+
+// handle_client_readable buffers what the client has sent and handles every
+// complete message in it
+void handle_client_readable(struct conn* c)
+{
+    if (fill_input(c) == -1)
+        return;
+    process_input(c);
+}
+
+// handle_backend_response forwards the response of a backend to the connection
+// that was waiting on it and moves that connection to its next state
+void handle_backend_response(struct pending* p, struct conn* c, char buf_response[])
+{
+    if (p->query == -1) {
+        if (c->state != CONN_AUTH_WAIT)
+            return;
+        log_info("The main server received the result of the authentication request from ServerC using UDP over port %s.\n", UDP_PORT);
+        // response of "2" means the authentication was successful, move on to course query stage
+        if (strcmp(buf_response, "2") == 0)
+            c->state = CONN_QUERY;
+        else
+            c->state = CONN_LOGIN;
+        if (send_msg(c, MSG_LOGIN_RESULT, c->login_tag, buf_response) == -1)
+            return;
+        log_info("The main server sent the authentication result to the client.\n");
+        // a token lets the client skip serverC when it reconnects
+        char token[MAXTOKENLEN];
+        if (c->state == CONN_QUERY && session_issue(&sessions, c->username, time(NULL), token, sizeof token) == 0
+                && send_msg(c, MSG_SESSION, c->login_tag, token) == -1)
+            return;
+        // the client gets 3 attempts; hang up once the last failure has been delivered
+        if (c->state == CONN_LOGIN && c->remaining_attempts == 0) {
+            c->closing = true;
+            return;
+        }
+    }
+    else {
+        struct query* query = c->queries[p->query];
+        if (query == NULL || !query->in_use || query->seq != p->query_seq)
+            return;
+        log_info("The main server received the response from %s using UDP over port %s.\n", p->b->name, UDP_PORT);
+        cache_put(&query_cache, query->answers[p->item], buf_response, now);
+        snprintf(query->answers[p->item], MAXANSWERLEN, "%s", buf_response);
+        if (--query->batch_outstanding > 0 || send_answers(c, p->query) == -1)
+            return;
+    }
+    // the connection may take the next request the client has pipelined
+    process_input(c);
+}
+
+// handle_backend_failure answers the request that was waiting on a backend which
+// never responded with "Unavailable", so the client is not left hanging. A login
+// that could not be checked does not count as a failed attempt.
+void handle_backend_failure(struct pending* p, struct conn* c)
+{
+    if (p->query == -1) {
+        if (c->state != CONN_AUTH_WAIT)
+            return;
+        c->state = CONN_LOGIN;
+        c->remaining_attempts++;
+        if (send_msg(c, MSG_LOGIN_RESULT, c->login_tag, "Unavailable") == -1)
+            return;
+    }
+    else {
+        struct query* query = c->queries[p->query];
+        if (query == NULL || !query->in_use || query->seq != p->query_seq)
+            return;
+        strcpy(query->answers[p->item], "Unavailable");
+        if (--query->batch_outstanding > 0 || send_answers(c, p->query) == -1)
+            return;
+    }
+    process_input(c);
+}
+
+// expire_pendings sends the requests whose attempt has timed out again, to another
+// instance of the backend if it has one, waiting twice as long for each retry,
+// and gives up on them after the last retry. A health probe is not retried.
+void expire_pendings()
+{
+    for (int i = 0; i <= udp_retries; i++) {
+        while (timers[i].head != -1 && pendings[timers[i].head].deadline_us <= now_us) {
+            int slot = timers[i].head;
+            struct pending* p = &pendings[slot];
+            if (p->fd == -1) {
+                struct backend* b = p->b;
+                int endpoint = p->endpoint;
+                release_pending(slot);
+                handle_probe_result(b, endpoint, false);
+                continue;
+            }
+            if (p->attempt < udp_retries) {
+                // try another instance of the backend, if there is a healthy one
+                struct endpoint* endpoints = p->b->endpoints;
+                timer_remove(slot);
+                endpoints[p->endpoint].outstanding--;
+                p->endpoint = pick_other_endpoint(p->b, p->endpoint);
+                endpoints[p->endpoint].outstanding++;
+                p->attempt++;
+                timer_add(slot);
+                p->b->retries++;
+                udp_send(endpoints[p->endpoint].addr, p->req_id, p->request);
+                log_info("The main server timed out waiting for %s and sent the request again.\n", p->b->name);
+                continue;
+            }
+            struct pending failed = *p;
+            release_pending(slot);
+            failed.b->failures++;
+            log_notice("The main server gave up waiting for %s.\n", failed.b->name);
+            struct conn* c = conns[failed.fd];
+            if (c != NULL && c->id == failed.conn_id)
+                handle_backend_failure(&failed, c);
+        }
+    }
+}
+
+// print_backend_stats prints the response time percentiles of each backend, in
+// microseconds, with its retry and failure counts
+void print_backend_stats()
+{
+    for (int i = 0; i < routing.num_backends; i++) {
+        struct backend* b = &routing.backends[i];
+        log_notice("%s: %llu responses, p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us, %lu retries, %lu failures\n",
+               b->name, (unsigned long long)b->latency.count,
+               (unsigned long long)hist_percentile(&b->latency, 50),
+               (unsigned long long)hist_percentile(&b->latency, 99),
+               (unsigned long long)hist_percentile(&b->latency, 99.9),
+               (unsigned long long)b->latency.max, b->retries, b->failures);
+        for (int e = 0; e < b->num_endpoints; e++) {
+            log_notice("  %s:%s: %d outstanding, %s\n", b->endpoints[e].host, b->endpoints[e].port,
+                   b->endpoints[e].outstanding, b->endpoints[e].healthy ? "healthy" : "ejected");
+        }
+    }
+}
+
+// handle_udp_readable drains responses from servers C/CS/EE, up to UDP_BATCH per
+// recvmmsg() call, and routes each one, by its request ID, to the connection
+// waiting on it
+void handle_udp_readable()
+{
+    int n;
+    while (1) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            udp_in_iovs[i].iov_base = udp_in_bufs[i];
+            udp_in_iovs[i].iov_len = UDP_HDR_LEN + MAXANSWERLEN - 1;
+            memset(&udp_in_msgs[i], 0, sizeof udp_in_msgs[i]);
+            udp_in_msgs[i].msg_hdr.msg_iov = &udp_in_iovs[i];
+            udp_in_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        if ((n = recvmmsg(udp_fd, udp_in_msgs, UDP_BATCH, 0, NULL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            char* datagram = udp_in_bufs[i];
+            int numbytes = udp_in_msgs[i].msg_len;
+            if (numbytes < UDP_HDR_LEN)
+                continue;
+            datagram[numbytes] = '\0';
+            uint32_t req_id = udp_get_req_id(datagram);
+            int slot = req_id & (MAXPENDING - 1);
+            // drop duplicates and responses to requests that are no longer pending
+            if (req_id == 0 || pendings[slot].req_id != req_id)
+                continue;
+            struct pending p = pendings[slot];
+            release_pending(slot);
+            if (p.fd == -1) {
+                handle_probe_result(p.b, p.endpoint, true);
+                continue;
+            }
+            hist_record(&p.b->latency, now_us - p.sent_us);
+            // drop the response if its connection has gone away in the meantime
+            struct conn* c = conns[p.fd];
+            if (c == NULL || c->id != p.conn_id)
+                continue;
+            handle_backend_response(&p, c, datagram + UDP_HDR_LEN);
+        }
+        if (n < UDP_BATCH)
+            return;
+    }
+}
+
+// handle_accept accepts every pending client connection
+void handle_accept(int sockfd)
+{
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size;
+    int new_fd;
+
+    while (1) {
         sin_size = sizeof their_addr;
         new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
         if (new_fd == -1) {
-            perror("accept");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        if (set_nonblocking(new_fd) == -1) {
+            close(new_fd);
             continue;
         }
+        conn_open(new_fd);
+    }
+}
 
-        if (!fork()) {
-            close(sockfd);
-            int remaining_attempts = 3;
-            client_connected = false;
-            client_authenticated = false;
-            char* username = NULL;
-
-            // loop through max of 3 attempts for client to login
-            while (remaining_attempts > 0) {
-                remaining_attempts--;
-                // receive login request
-                recv_str(new_fd, buf_username_password_copy);
-                strcpy(buf_username_password, buf_username_password_copy);
-                username = strtok(buf_username_password_copy, ",");
-                printf("The main server received the authentication for %s using TCP over port %s.\n", username, PORT);
-                encrypt(buf_username_password);
-                // send encrypted login request to serverC
-                udp_send(udp_fd, udp_C_p, buf_username_password);
-                printf("The main server sent an authentication request to serverC.\n");
-                // receive login response from serverC and send it to the client
-                udp_receive(udp_fd, their_addr_server, sin_size_server, buf_response);
-                printf("The main server received the result of the authentication request from ServerC using UDP over port %s.\n", UDP_PORT);
-                send_str(new_fd, buf_response);
-                printf("The main server sent the authentication result to the client.\n");
-                // response of "2" means the authentication was successful, move on to course query stage
-                if (strcmp(buf_response, "2") == 0) {
-                    client_authenticated = true;
-                    break;
-                }
-            }
+int main(int argc, char *argv[])
+{
+    struct epoll_event ev, events[MAXEVENTS];
+    struct sigaction sa;
+    int opt;
+    int cache_ttl = CACHE_TTL;
+    int cache_entries = CACHE_ENTRIES;
+    char* routing_file = NULL;
+    char* key_file = NULL;
+    char* log_level_name = NULL;
+    char* log_sample_rate = NULL;
+    int session_lifetime = SESSION_LIFETIME;
+    char default_routing[] = DEFAULT_ROUTING;
+
+    // -t sets how long course query answers are cached (0 disables the cache),
+    // -c how many are kept; -d sets how long to wait for the first response of a
+    // backend, -r how many times a request is sent again; -f reads the routing
+    // table from a file; -i sets the time between health probes (0 disables them);
+    // -s sets how long session tokens are valid (0 disables them), -k reads the
+    // key they are signed with from a file; -m sets the seconds between metrics
+    // dumps (0, the default, dumps them only on SIGUSR1); -l sets the log level
+    // and -S keeps only one in N per-request log lines
+    while ((opt = getopt(argc, argv, "t:c:d:r:f:i:s:k:m:l:S:")) != -1) {
+        if (opt == 't')
+            cache_ttl = atoi(optarg);
+        else if (opt == 'c')
+            cache_entries = atoi(optarg);
+        else if (opt == 'd')
+            udp_timeout_ms = atoi(optarg);
+        else if (opt == 'r')
+            udp_retries = atoi(optarg);
+        else if (opt == 'f')
+            routing_file = optarg;
+        else if (opt == 'i')
+            probe_interval_ms = atoi(optarg);
+        else if (opt == 's')
+            session_lifetime = atoi(optarg);
+        else if (opt == 'k')
+            key_file = optarg;
+        else if (opt == 'm')
+            metrics_interval = atoi(optarg);
+        else if (opt == 'l')
+            log_level_name = optarg;
+        else if (opt == 'S')
+            log_sample_rate = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-t cache_ttl_seconds] [-c cache_entries] [-d backend_timeout_ms] [-r backend_retries] [-f routing_file] [-i probe_interval_ms] [-s session_seconds] [-k session_key_file] [-m metrics_seconds] [-l error|notice|info|debug] [-S sample_one_in_n]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (udp_timeout_ms < 1 || udp_retries < 0 || udp_retries > MAXRETRIES || probe_interval_ms < 0) {
+        fprintf(stderr, "%s: the backend timeout must be positive, the retries between 0 and %d and the probe interval not negative\n", argv[0], MAXRETRIES);
+        exit(1);
+    }
+    if (log_parse_options(log_level_name, log_sample_rate) == -1) {
+        fprintf(stderr, "%s: unknown log level, or sampling below 1\n", argv[0]);
+        exit(1);
+    }
+    if (log_start() == -1)
+        exit(1);
+    if (cache_init(&query_cache, cache_entries, cache_ttl) == -1)
+        exit(1);
+    if (sessions_init(&sessions, key_file, session_lifetime) == -1)
+        exit(1);
+    if (metrics_init(&metrics, "The main server", stage_names, NUM_STAGES, counter_names, NUM_COUNTERS, 1) == -1)
+        exit(1);
+    if (routing_file != NULL ? read_routing_file(&routing, routing_file) == -1
+                             : parse_routing(&routing, default_routing, "default routing") == -1)
+        exit(1);
+
+    // initialize TCP server and UDP client
+    int sockfd = start_tcp_server();
+    udp_fd = start_udp_client();
+    for (int i = 0; i < routing.num_backends; i++) {
+        struct backend* b = &routing.backends[i];
+        for (int e = 0; e < b->num_endpoints; e++) {
+            if ((b->endpoints[e].addr = configure_udp_server(b->endpoints[e].host, b->endpoints[e].port)) == NULL)
+                exit(1);
+        }
+    }
+    init_pendings();
 
-            if (client_authenticated) {
-                client_connected = true;
-                // loop to service course requests
-                while(client_connected) {
-                    // receive course queries
-                    recv_str(new_fd, buf_course_category_copy);
-                    strcpy(buf_course_category, buf_course_category_copy);
-                    char* course = strtok(buf_course_category_copy, ",");
-                    char* category = strtok(NULL, ",");
-                    // detect that the client has disconnected
-                    if (!course && !category) {
-                        client_connected = false;
-                        break;
-                    }
-                    printf("The main server received from %s to query course %s about %s using TCP over port %s.\n", username, course, category, PORT);
-                    memcpy(buf_department, buf_course_category, 2);
-                    buf_department[2] = '\0';
-                    // determine if the request should be sent to the EE server or the CS server.
-                    // Then send the request, and receive the requested data/ failure code
-                    if (strcmp(buf_department, "EE") == 0) {
-                        udp_send(udp_fd, udp_EE_p, buf_course_category);
-                        printf("The main server sent a request to serverEE.\n");
-                        udp_receive(udp_fd, their_addr_server, sin_size_server, buf_response);
-                        printf("The main server received the response from serverEE using UDP over port %s.\n", UDP_PORT);
-                        send_str(new_fd, buf_response);
-                        printf("The main server sent the query information to the client.\n");
-                    }
-                    else if (strcmp(buf_department, "CS") == 0) {
-                        udp_send(udp_fd, udp_CS_p, buf_course_category);
-                        printf("The main server sent a request to serverCS.\n");
-                        udp_receive(udp_fd, their_addr_server, sin_size_server, buf_response);
-                        printf("The main server received the response from serverCS using UDP over port %s.\n", UDP_PORT);
-                        send_str(new_fd, buf_response);
-                        printf("The main server sent the query information to the client.\n");
-                    }
-                    // if the department is not CS or EE, return failure code
-                    else {
-                        printf("The main server received request with invalid department.\n");
-                        send_str(new_fd, "None");
-                        printf("The main server sent the query information to the client.\n");
-                    }
-                }
+    // a client disappearing mid-response must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    // SIGHUP flushes the query cache
+    sa.sa_handler = sighup_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+    // SIGUSR1 prints the metrics and backend latency statistics
+    sa.sa_handler = sigusr1_handler;
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if (set_nonblocking(sockfd) == -1 || set_nonblocking(udp_fd) == -1)
+        exit(1);
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = udp_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, udp_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    log_notice("The main server is up and running.\n");
+    update_now();
+    next_metrics_us = now_us + (uint64_t)metrics_interval * 1000000;
+    // event loop servicing all clients and backend responses, and waking up in
+    // time for the next backend request to time out
+    while(1) {
+        int n = epoll_wait(epfd, events, MAXEVENTS, next_timeout());
+        if (invalidate_requested) {
+            invalidate_requested = 0;
+            cache_invalidate(&query_cache);
+            log_notice("The main server invalidated its query cache.\n");
+        }
+        update_now();
+        if (stats_requested || (metrics_interval > 0 && now_us >= next_metrics_us)) {
+            stats_requested = 0;
+            next_metrics_us = now_us + (uint64_t)metrics_interval * 1000000;
+            metrics_dump(&metrics);
+            print_backend_stats();
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == sockfd) {
+                handle_accept(sockfd);
+                continue;
             }
-            close(new_fd);
-            exit(0);
+            if (fd == udp_fd) {
+                handle_udp_readable();
+                continue;
+            }
+            // the connection may have been closed earlier in this batch
+            struct conn* c = conns[fd];
+            if (c == NULL)
+                continue;
+            if (events[i].events & EPOLLOUT) {
+                // flushing may make room for responses to buffered requests
+                if (conn_flush(c) == -1 || process_input(c) == -1)
+                    continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                handle_client_readable(c);
         }
-        close(new_fd);
+        expire_pendings();
+        send_probes();
+        flush_udp();
+        flush_dirty();
     }
     return 0;
 }
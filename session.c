@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "session.h"
+
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+// load_le64 reads 8 bytes as a little-endian number
+static uint64_t load_le64(const uint8_t* p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// siphash24 computes the SipHash-2-4 of len bytes of data under key, following
+// the reference implementation by Aumasson and Bernstein
+static uint64_t siphash24(const uint8_t key[SESSION_KEY_LEN], const uint8_t* data, size_t len)
+{
+    uint64_t k0 = load_le64(key);
+    uint64_t k1 = load_le64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ull ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dull ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ull ^ k0;
+    uint64_t v3 = 0x7465646279746573ull ^ k1;
+    const uint8_t* end = data + len - len % 8;
+    uint64_t m;
+
+    for (; data != end; data += 8) {
+        m = load_le64(data);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    // the last block holds the remaining bytes and the length in its top byte
+    m = (uint64_t)len << 56;
+    for (int i = len % 8 - 1; i >= 0; i--)
+        m |= (uint64_t)data[i] << (8 * i);
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xff;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// sessions_init sets up token signing. The key is read from key_file, so that
+// tokens stay valid across restarts and between serverM instances sharing the
+// file, or drawn at random if key_file is NULL. Returns -1 on failure.
+int sessions_init(struct sessions* s, const char* key_file, int lifetime)
+{
+    s->lifetime = lifetime;
+    if (key_file == NULL) {
+        if (getrandom(s->key, sizeof s->key, 0) != sizeof s->key) {
+            perror("getrandom");
+            return -1;
+        }
+        return 0;
+    }
+    FILE* fp = fopen(key_file, "rb");
+    if (fp == NULL) {
+        perror(key_file);
+        return -1;
+    }
+    size_t n = fread(s->key, 1, sizeof s->key, fp);
+    fclose(fp);
+    if (n != sizeof s->key) {
+        fprintf(stderr, "%s: the key must be %d bytes\n", key_file, SESSION_KEY_LEN);
+        return -1;
+    }
+    return 0;
+}
+
+// session_issue writes a token for username, valid for the session lifetime from
+// now, into token. Returns -1 if tokens are disabled or it does not fit.
+int session_issue(const struct sessions* s, const char* username, time_t now, char token[], size_t size)
+{
+    if (s->lifetime <= 0)
+        return -1;
+    int len = snprintf(token, size, "%s:%lld", username, (long long)now + s->lifetime);
+    if (len < 0 || len + 18 > size)
+        return -1;
+    uint64_t mac = siphash24(s->key, (const uint8_t*)token, len);
+    snprintf(token + len, size - len, ":%016llx", (unsigned long long)mac);
+    return 0;
+}
+
+// session_verify checks that token was issued with this key and has not expired,
+// and stores the username it was issued for. Returns -1 if it is not valid.
+int session_verify(const struct sessions* s, const char* token, time_t now, char username[], size_t size)
+{
+    if (s->lifetime <= 0)
+        return -1;
+    const char* mac_sep = strrchr(token, ':');
+    if (mac_sep == NULL || strlen(mac_sep + 1) != 16)
+        return -1;
+    const char* expiry_sep = mac_sep;
+    while (expiry_sep > token && expiry_sep[-1] != ':')
+        expiry_sep--;
+    if (expiry_sep == token)
+        return -1;
+    expiry_sep--;
+
+    // compare every digit, so the time taken does not tell how many were right
+    char expected[17];
+    snprintf(expected, sizeof expected, "%016llx",
+             (unsigned long long)siphash24(s->key, (const uint8_t*)token, mac_sep - token));
+    unsigned char diff = 0;
+    for (int i = 0; i < 16; i++)
+        diff |= expected[i] ^ mac_sep[1 + i];
+    if (diff != 0)
+        return -1;
+
+    if (strtoll(expiry_sep + 1, NULL, 10) < now)
+        return -1;
+    size_t username_len = expiry_sep - token;
+    if (username_len >= size)
+        return -1;
+    memcpy(username, token, username_len);
+    username[username_len] = '\0';
+    return 0;
+}
@@ -0,0 +1,26 @@
+// session.h declares the signed session tokens serverM hands out after a
+// successful login, so a client can reconnect without serverC checking its
+// password again
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define SESSION_KEY_LEN 16
+#define MAXTOKENLEN 160  // longest token, NUL included
+
+// sessions holds the key tokens are signed with. A token reads
+// "username:expiry:mac", expiry being in seconds since the epoch and mac the
+// SipHash-2-4 of "username:expiry" under the key, in hex.
+struct sessions {
+    uint8_t key[SESSION_KEY_LEN];
+    int lifetime;  // seconds a token is valid; 0 disables tokens
+};
+
+int sessions_init(struct sessions* s, const char* key_file, int lifetime);
+int session_issue(const struct sessions* s, const char* username, time_t now, char token[], size_t size);
+int session_verify(const struct sessions* s, const char* token, time_t now, char username[], size_t size);
+
+#endif
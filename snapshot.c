@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.h"
+
+
+// snapshot compiles a data file of the servers C/CS/EE into a binary snapshot,
+// which the server then maps at startup instead of parsing the data file:
+//
+//     ./snapshot cred.txt cred.snap 2
+//     ./snapshot cs.txt cs.snap 5
+//     ./snapshot ee.txt ee.snap 5
+//
+// The last argument is the number of fields per line. A server only uses its
+// snapshot while it is at least as new as the data file.
+int main(int argc, char *argv[])
+{
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s data_file snapshot_file num_fields\n", argv[0]);
+        exit(1);
+    }
+    int num_fields = atoi(argv[3]);
+    if (num_fields < 1 || num_fields > MAXFIELDS) {
+        fprintf(stderr, "%s: number of fields must be between 1 and %d\n", argv[0], MAXFIELDS);
+        exit(1);
+    }
+
+    struct table* t = load_text_table(argv[1], num_fields);
+    if (t == NULL)
+        exit(1);
+    if (write_snapshot(t, argv[2]) == -1)
+        exit(1);
+    printf("Wrote %s: %u rows, %u keys.\n", argv[2], t->num_rows, t->num_keys);
+    free_table(t);
+    return 0;
+}
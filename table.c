@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "table.h"
+
+
+// table_field returns a view of one field of a row
+struct str_view table_field(const struct table* t, uint32_t row, int field)
+{
+    const struct field_ref* ref = &t->records[(size_t)row * t->num_fields + field];
+    struct str_view view = { t->pool + ref->off, ref->len };
+    return view;
+}
+
+// find_slot returns the index slot holding key, or the empty slot where it would
+// be inserted
+static uint32_t find_slot(const struct table* t, const uint32_t* index, struct str_view key)
+{
+    uint32_t i = hash_view(key) & t->index_mask;
+    while (index[i] != 0) {
+        if (view_equals(table_field(t, index[i] - 1, 0), key))
+            break;
+        i = (i + 1) & t->index_mask;
+    }
+    return i;
+}
+
+// find_row looks up the row whose first field is key; returns the row number + 1,
+// or 0 if there is none
+uint32_t find_row(const struct table* t, struct str_view key)
+{
+    return t->index[find_slot(t, t->index, key)];
+}
+
+// build_index indexes the rows of t by their first field, into an index at most
+// half full so probe sequences stay short. Like a top-to-bottom scan, the first
+// row for a key wins.
+static int build_index(struct table* t)
+{
+    uint32_t index_size = 16;
+    while (index_size < 2 * t->num_rows)
+        index_size *= 2;
+    uint32_t* index = calloc(index_size, sizeof(uint32_t));
+    if (index == NULL)
+        return -1;
+    t->index_mask = index_size - 1;
+    t->num_keys = 0;
+    for (uint32_t row = 0; row < t->num_rows; row++) {
+        uint32_t slot = find_slot(t, index, table_field(t, row, 0));
+        if (index[slot] == 0) {
+            index[slot] = row + 1;
+            t->num_keys++;
+        }
+    }
+    t->index = index;
+    return 0;
+}
+
+// load_text_table maps a text data file, one row per line with fields separated
+// by ',', and indexes it in place: one pass over the file collects the fields of
+// each line into the record table, which grows as needed. Lines with fewer than
+// num_fields fields are skipped; the last field takes the rest of the line.
+// Returns NULL on failure.
+struct table* load_text_table(const char* path, int num_fields)
+{
+    struct table* t = calloc(1, sizeof(struct table));
+    if (t == NULL)
+        return NULL;
+    t->num_fields = num_fields;
+    if (map_data_file(path, &t->file) == -1) {
+        free(t);
+        return NULL;
+    }
+    t->pool = t->file.ptr;
+
+    struct field_ref* records = NULL;
+    uint32_t max_rows = 0;
+    struct str_view rest = t->file;
+    struct str_view line;
+    while (next_token(&rest, '\n', &line)) {
+        struct str_view row[MAXFIELDS];
+        int f = 0;
+        while (f < num_fields - 1 && next_token(&line, ',', &row[f]))
+            f++;
+        if (f < num_fields - 1 || line.ptr == NULL)
+            continue;
+        row[f] = line;
+        if (t->num_rows == max_rows) {
+            max_rows = max_rows ? 2 * max_rows : 16;
+            struct field_ref* grown = realloc(records, (size_t)max_rows * num_fields * sizeof(struct field_ref));
+            if (grown == NULL) {
+                free(records);
+                unmap_data_file(t->file);
+                free(t);
+                return NULL;
+            }
+            records = grown;
+        }
+        for (f = 0; f < num_fields; f++) {
+            struct str_view field = trim_view(row[f]);
+            struct field_ref* ref = &records[(size_t)t->num_rows * num_fields + f];
+            ref->off = field.ptr - t->pool;
+            ref->len = field.len;
+        }
+        t->num_rows++;
+    }
+    t->records = records;
+
+    if (build_index(t) == -1) {
+        free(records);
+        unmap_data_file(t->file);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// snapshot_body_is_valid checks the sections of a snapshot whose header checked
+// out: every field must lie within the string pool and every index entry name a
+// row, and the index needs an empty slot for a lookup of a missing key to end.
+// One pass over them is still much less work than parsing the text.
+static int snapshot_body_is_valid(const struct snapshot_header* hdr, const char* base)
+{
+    const struct field_ref* records = (const struct field_ref*)(base + hdr->records_off);
+    const uint32_t* index = (const uint32_t*)(base + hdr->index_off);
+    uint64_t num_refs = (uint64_t)hdr->num_rows * hdr->num_fields;
+    for (uint64_t i = 0; i < num_refs; i++) {
+        if ((uint64_t)records[i].off + records[i].len > hdr->pool_len)
+            return 0;
+    }
+    int has_empty_slot = 0;
+    for (uint32_t i = 0; i < hdr->index_size; i++) {
+        if (index[i] > hdr->num_rows)
+            return 0;
+        if (index[i] == 0)
+            has_empty_slot = 1;
+    }
+    return has_empty_slot;
+}
+
+// load_snapshot maps a snapshot written by write_snapshot. Its index is used as
+// is, so the table is ready as soon as the header and the bounds of its fields
+// and index entries check out. Returns NULL if the file cannot be mapped, or was
+// written for another version, byte order or number of fields, or its sections
+// do not fit in it or point outside it.
+struct table* load_snapshot(const char* path, int num_fields)
+{
+    struct table* t = calloc(1, sizeof(struct table));
+    if (t == NULL)
+        return NULL;
+    t->is_snapshot = 1;
+    if (map_data_file(path, &t->file) == -1) {
+        free(t);
+        return NULL;
+    }
+
+    const struct snapshot_header* hdr = (const struct snapshot_header*)t->file.ptr;
+    uint64_t size = t->file.len;
+    if (size < sizeof *hdr || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof hdr->magic) != 0
+            || hdr->version != SNAPSHOT_VERSION || hdr->byte_order != SNAPSHOT_BYTE_ORDER
+            || hdr->num_fields != (uint32_t)num_fields
+            || hdr->index_size < 16 || (hdr->index_size & (hdr->index_size - 1)) != 0
+            || hdr->pool_off > size || hdr->pool_len > size - hdr->pool_off
+            || hdr->records_off % 8 != 0 || hdr->records_off > size
+            || (uint64_t)hdr->num_rows * num_fields * sizeof(struct field_ref) > size - hdr->records_off
+            || hdr->index_off % 8 != 0 || hdr->index_off > size
+            || (uint64_t)hdr->index_size * sizeof(uint32_t) > size - hdr->index_off
+            || !snapshot_body_is_valid(hdr, t->file.ptr)) {
+        fprintf(stderr, "%s: not a valid version %d snapshot of %d fields\n", path, SNAPSHOT_VERSION, num_fields);
+        unmap_data_file(t->file);
+        free(t);
+        return NULL;
+    }
+    t->num_fields = hdr->num_fields;
+    t->num_rows = hdr->num_rows;
+    t->num_keys = hdr->num_keys;
+    t->pool = t->file.ptr + hdr->pool_off;
+    t->records = (const struct field_ref*)(t->file.ptr + hdr->records_off);
+    t->index = (const uint32_t*)(t->file.ptr + hdr->index_off);
+    t->index_mask = hdr->index_size - 1;
+    return t;
+}
+
+// is_older tells whether modification time a is before b
+static int is_older(struct timespec a, struct timespec b)
+{
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// load_table loads the snapshot of a data file if there is one at least as new
+// as the data file, and parses the data file otherwise. Returns NULL on failure.
+struct table* load_table(const char* text_path, const char* snapshot_path, int num_fields)
+{
+    struct stat text_st, snapshot_st;
+    if (stat(snapshot_path, &snapshot_st) == 0
+            && (stat(text_path, &text_st) == -1 || !is_older(snapshot_st.st_mtim, text_st.st_mtim))) {
+        struct table* t = load_snapshot(snapshot_path, num_fields);
+        if (t != NULL)
+            return t;
+    }
+    return load_text_table(text_path, num_fields);
+}
+
+// write_padded writes len bytes followed by zeros up to the next multiple of 8
+static int write_padded(FILE* fp, const void* data, uint64_t len)
+{
+    static const char zeros[8];
+    uint64_t pad = (8 - len % 8) % 8;
+    if (fwrite(data, 1, len, fp) != len || fwrite(zeros, 1, pad, fp) != pad)
+        return -1;
+    return 0;
+}
+
+// write_snapshot writes t as a snapshot to path. The string pool keeps only the
+// rows, back to back, each with its fields separated by a single ',', so the
+// fields of a row can still be sent together as one string, while padding and
+// skipped lines of the text file are dropped.
+// The file is written under a temporary name and renamed into place, so a server
+// never maps a half-written snapshot. Returns -1 on failure.
+int write_snapshot(const struct table* t, const char* path)
+{
+    size_t num_refs = (size_t)t->num_rows * t->num_fields;
+    struct field_ref* records = malloc(num_refs * sizeof(struct field_ref) + 1);
+    uint64_t pool_len = (uint64_t)t->num_rows * (t->num_fields - 1);
+    for (size_t i = 0; i < num_refs; i++)
+        pool_len += t->records[i].len;
+    if (pool_len > UINT32_MAX) {
+        fprintf(stderr, "%s: string pool too large\n", path);
+        free(records);
+        return -1;
+    }
+    char* pool = malloc(pool_len + 1);
+    if (records == NULL || pool == NULL) {
+        free(records);
+        free(pool);
+        return -1;
+    }
+    // copy each field into the pool, with a ',' before every field but the first of a row
+    uint64_t len = 0;
+    for (size_t i = 0; i < num_refs; i++) {
+        if (i % t->num_fields != 0)
+            pool[len++] = ',';
+        memcpy(pool + len, t->pool + t->records[i].off, t->records[i].len);
+        records[i].off = len;
+        records[i].len = t->records[i].len;
+        len += records[i].len;
+    }
+
+    struct snapshot_header hdr;
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof hdr.magic);
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+    hdr.num_fields = t->num_fields;
+    hdr.num_rows = t->num_rows;
+    hdr.num_keys = t->num_keys;
+    hdr.index_size = t->index_mask + 1;
+    hdr.pool_off = sizeof hdr + (8 - sizeof hdr % 8) % 8;
+    hdr.pool_len = pool_len;
+    hdr.records_off = hdr.pool_off + pool_len + (8 - pool_len % 8) % 8;
+    hdr.index_off = hdr.records_off + num_refs * sizeof(struct field_ref);
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+    FILE* fp = fopen(tmp_path, "wb");
+    int ok = fp != NULL
+        && write_padded(fp, &hdr, sizeof hdr) == 0
+        && write_padded(fp, pool, pool_len) == 0
+        && write_padded(fp, records, num_refs * sizeof(struct field_ref)) == 0
+        && write_padded(fp, t->index, (uint64_t)hdr.index_size * sizeof(uint32_t)) == 0;
+    if (fp != NULL && fclose(fp) != 0)
+        ok = 0;
+    free(records);
+    free(pool);
+    if (!ok || rename(tmp_path, path) == -1) {
+        perror(path);
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// free_table unmaps the file of t and frees what was allocated for it
+void free_table(struct table* t)
+{
+    if (!t->is_snapshot) {
+        free((void*)t->records);
+        free((void*)t->index);
+    }
+    unmap_data_file(t->file);
+    free(t);
+}
@@ -0,0 +1,66 @@
+// table.h declares the read-only tables the servers C/CS/EE answer from: rows of
+// string fields indexed by their first field, loaded either by parsing a text
+// data file or by mapping a binary snapshot of one
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stdint.h>
+
+#include "datafile.h"
+
+#define MAXFIELDS 8
+
+// A snapshot file is laid out as: header, string pool, record table, hash index.
+// Sections start at multiples of 8 bytes and use the byte order of the host that
+// wrote the file. Bump SNAPSHOT_VERSION whenever the layout, or the hash used by
+// the index, changes.
+#define SNAPSHOT_MAGIC "EE450TBL"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+// field_ref is one field of a row, as a range of the string pool
+struct field_ref {
+    uint32_t off;
+    uint32_t len;
+};
+
+// snapshot_header is the start of a snapshot file; offsets are from the start
+// of the file
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  // SNAPSHOT_BYTE_ORDER as the writer stored it
+    uint32_t num_fields;
+    uint32_t num_rows;
+    uint32_t num_keys;  // distinct first fields
+    uint32_t index_size;  // a power of two
+    uint64_t pool_off;
+    uint64_t pool_len;
+    uint64_t records_off;  // num_rows * num_fields field_refs, row by row
+    uint64_t index_off;  // index_size row numbers + 1, 0 for an empty slot
+};
+
+// table is a loaded table. Built from a text file, the pool is the mapped text
+// and the records and index are allocated; from a snapshot, all three point
+// into the mapped snapshot.
+struct table {
+    uint32_t num_fields;
+    uint32_t num_rows;
+    uint32_t num_keys;
+    const char* pool;
+    const struct field_ref* records;
+    const uint32_t* index;  // open-addressing hash index on the first field
+    uint32_t index_mask;  // index size - 1
+    struct str_view file;  // the mapped file
+    int is_snapshot;
+};
+
+struct table* load_text_table(const char* path, int num_fields);
+struct table* load_snapshot(const char* path, int num_fields);
+struct table* load_table(const char* text_path, const char* snapshot_path, int num_fields);
+int write_snapshot(const struct table* t, const char* path);
+void free_table(struct table* t);
+uint32_t find_row(const struct table* t, struct str_view key);
+struct str_view table_field(const struct table* t, uint32_t row, int field);
+
+#endif
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <linux/filter.h>
+#include <signal.h>
+
+#include "protocol.h"
+#include "udp_server.h"
+#include "log.h"
+
+
+#define OFFLINE ULONG_MAX  // quiescent value of a worker that holds no table
+
+// stages of answering a batch of datagrams whose latencies a worker records
+enum worker_stage {
+    STAGE_LOOKUP,  // the handler answering one request
+    STAGE_SEND,  // the sendmmsg() of a batch of responses
+    STAGE_TURNAROUND,  // a batch, from its recvmmsg() returning to its responses being sent
+    NUM_STAGES
+};
+
+enum worker_counter {
+    COUNTER_REQUESTS,
+    COUNTER_PROBES,
+    COUNTER_BATCHES,
+    NUM_COUNTERS
+};
+
+const char* const stage_names[NUM_STAGES] = { "lookup", "send", "turnaround" };
+const char* const counter_names[NUM_COUNTERS] = { "requests", "probes", "batches" };
+
+// worker is the state of one worker thread, including the message vectors it
+// receives and answers a batch of datagrams with
+struct worker {
+    struct udp_server* srv;
+    int sockfd;
+    // generation of the server when the worker took the table it is answering
+    // from, or OFFLINE between batches; an old table can be freed once every
+    // worker is past its generation
+    atomic_ulong quiescent;
+    struct metrics_slot* metrics;
+    char bufs[UDP_BATCH][UDP_HDR_LEN + UDP_MAXLEN];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec resp_iovs[UDP_BATCH][2];  // request ID of the request, response
+    struct mmsghdr resp_msgs[UDP_BATCH];
+};
+
+// parse_server_options reads the number of worker threads from the "-w N" command
+// line option, defaulting to 1, a single-threaded server, the port from "-p port",
+// so several instances of a server can run side by side, from "-m N" how many
+// seconds apart the metrics are dumped, and the log level and sampling from
+// "-l level" and "-S N"; srv->port holds the default port on entry
+void parse_server_options(struct udp_server* srv, int argc, char* argv[])
+{
+    int opt;
+    srv->num_workers = 1;
+    srv->metrics_interval = 0;
+    char* level = NULL;
+    char* sample = NULL;
+    while ((opt = getopt(argc, argv, "w:p:m:l:S:")) != -1) {
+        if (opt == 'w') {
+            srv->num_workers = atoi(optarg);
+            if (srv->num_workers < 1 || srv->num_workers > MAXWORKERS) {
+                fprintf(stderr, "%s: worker count must be between 1 and %d\n", argv[0], MAXWORKERS);
+                exit(1);
+            }
+        }
+        else if (opt == 'p')
+            srv->port = optarg;
+        else if (opt == 'm')
+            srv->metrics_interval = atoi(optarg);
+        else if (opt == 'l')
+            level = optarg;
+        else if (opt == 'S')
+            sample = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-w workers] [-p port] [-m metrics_seconds] [-l error|notice|info|debug] [-S sample_one_in_n]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (log_parse_options(level, sample) == -1) {
+        fprintf(stderr, "%s: unknown log level, or sampling below 1\n", argv[0]);
+        exit(1);
+    }
+}
+
+// bind_udp_socket function was heavily inspired by Beej's Guide to Network Programming
+// (6.3 Datagram Sockets, listener.c)
+int bind_udp_socket(const char port[])
+{
+    int sockfd;
+    struct addrinfo hints, *servinfo, *p;
+    int rv;
+    int yes = 1;
+    int rcvbuf = UDP_RCVBUF;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET6;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    // assign socket and return descriptor
+    for(p = servinfo; p != NULL; p = p->ai_next) {
+        if ((sockfd = socket(p->ai_family, p->ai_socktype,
+                p->ai_protocol)) == -1) {
+            perror("listener: socket");
+            continue;
+        }
+        // every worker binds its own socket to the same port
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1) {
+            perror("setsockopt");
+            close(sockfd);
+            continue;
+        }
+        // past the rmem_max sysctl only a privileged process gets the full size
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof rcvbuf) == -1)
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(sockfd);
+            perror("listener: bind");
+            continue;
+        }
+        break;
+    }
+
+    freeaddrinfo(servinfo);
+    if (p == NULL) {
+        fprintf(stderr, "listener: failed to bind socket\n");
+        return -1;
+    }
+    return sockfd;
+}
+
+// steer_requests spreads datagrams over the worker sockets by request ID. By
+// default the kernel picks the socket from a hash of the source address, and
+// serverM sends everything from one address, so every request would land on the
+// same worker.
+int steer_requests(struct udp_server* srv)
+{
+    // the program sees the UDP payload; return request ID % num_workers, which is
+    // the index of the socket in the order the sockets were bound
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, srv->num_workers),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = { sizeof code / sizeof code[0], code };
+    if (setsockopt(srv->sockfds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog) == -1) {
+        perror("setsockopt");
+        return -1;
+    }
+    return 0;
+}
+
+// start_udp_server binds one socket per worker to the port. Returns -1 on failure.
+int start_udp_server(struct udp_server* srv)
+{
+    for (int i = 0; i < srv->num_workers; i++) {
+        if ((srv->sockfds[i] = bind_udp_socket(srv->port)) == -1)
+            return -1;
+    }
+    if (srv->num_workers > 1 && steer_requests(srv) == -1)
+        return -1;
+    srv->workers = NULL;
+    atomic_init(&srv->table, NULL);
+    atomic_init(&srv->generation, 0);
+    return 0;
+}
+
+// load_server_data loads the first table of the server. Returns -1 on failure.
+int load_server_data(struct udp_server* srv)
+{
+    struct table* t = srv->loader();
+    if (t == NULL)
+        return -1;
+    atomic_store(&srv->table, t);
+    return 0;
+}
+
+// udp_recv_and_respond waits for requests from the client over UDP, takes up to
+// UDP_BATCH of them with one recvmmsg() call, and responds to all of them with
+// one sendmmsg() call
+void udp_recv_and_respond(struct worker* w)
+{
+    struct udp_server* srv = w->srv;
+    int n;
+    for (int i = 0; i < UDP_BATCH; i++) {
+        w->iovs[i].iov_base = w->bufs[i];
+        w->iovs[i].iov_len = UDP_HDR_LEN + UDP_MAXLEN - 1;
+        memset(&w->msgs[i], 0, sizeof w->msgs[i]);
+        w->msgs[i].msg_hdr.msg_iov = &w->iovs[i];
+        w->msgs[i].msg_hdr.msg_iovlen = 1;
+        w->msgs[i].msg_hdr.msg_name = &w->addrs[i];
+        w->msgs[i].msg_hdr.msg_namelen = sizeof w->addrs[i];
+    }
+    // block for the first datagram, then take whatever else is already queued;
+    // no table is held while blocked, so a reload need not wait for this worker
+    atomic_store(&w->quiescent, OFFLINE);
+    if ((n = recvmmsg(w->sockfd, w->msgs, UDP_BATCH, MSG_WAITFORONE, NULL)) == -1) {
+        if (errno == EINTR)
+            return;
+        perror("recvmmsg");
+        exit(1);
+    }
+    // announce the generation before taking the table, so a reload that has
+    // published a newer table either sees this worker on its old one and waits,
+    // or this worker takes the newer table
+    atomic_store(&w->quiescent, atomic_load(&srv->generation));
+    const struct table* t = atomic_load(&srv->table);
+    uint64_t batch_start = metrics_now_ns();
+
+    int num_resps = 0;
+    int num_answers = 0;
+    for (int i = 0; i < n; i++) {
+        char* buf = w->bufs[i];
+        int numbytes = w->msgs[i].msg_len;
+        // ignore datagrams too short to carry a request ID
+        if (numbytes < UDP_HDR_LEN)
+            continue;
+        buf[numbytes] = '\0';
+
+        // a health probe is answered right away with an empty response
+        struct str_view resp = view_of("");
+        if (numbytes > UDP_HDR_LEN) {
+            uint64_t start = metrics_now_ns();
+            resp = srv->handler(t, buf + UDP_HDR_LEN);
+            metrics_record(w->metrics, STAGE_LOOKUP, metrics_now_ns() - start);
+            num_answers++;
+        }
+        if (resp.len > UDP_MAXLEN)
+            resp.len = UDP_MAXLEN;
+
+        // response to serverM, tagged with the request ID it came with; both
+        // parts are gathered by sendmmsg() from where they already are
+        struct iovec* iov = w->resp_iovs[num_resps];
+        iov[0].iov_base = buf;
+        iov[0].iov_len = UDP_HDR_LEN;
+        iov[1].iov_base = (void*)resp.ptr;
+        iov[1].iov_len = resp.len;
+        memset(&w->resp_msgs[num_resps], 0, sizeof w->resp_msgs[num_resps]);
+        w->resp_msgs[num_resps].msg_hdr.msg_iov = iov;
+        w->resp_msgs[num_resps].msg_hdr.msg_iovlen = 2;
+        w->resp_msgs[num_resps].msg_hdr.msg_name = &w->addrs[i];
+        w->resp_msgs[num_resps].msg_hdr.msg_namelen = w->msgs[i].msg_hdr.msg_namelen;
+        num_resps++;
+    }
+
+    // send responses to serverM
+    uint64_t send_start = metrics_now_ns();
+    int sent = 0;
+    while (sent < num_resps) {
+        if ((n = sendmmsg(w->sockfd, w->resp_msgs + sent, num_resps - sent, 0)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("senderr: sendmmsg");
+            exit(1);
+        }
+        sent += n;
+    }
+    uint64_t end = metrics_now_ns();
+    metrics_record(w->metrics, STAGE_SEND, end - send_start);
+    metrics_record(w->metrics, STAGE_TURNAROUND, end - batch_start);
+    metrics_count(w->metrics, COUNTER_REQUESTS, num_answers);
+    metrics_count(w->metrics, COUNTER_PROBES, num_resps - num_answers);
+    metrics_count(w->metrics, COUNTER_BATCHES, 1);
+    for (int i = 0; i < num_answers; i++)
+        log_info("The %s finished sending the response to the Main Server.\n", srv->name);
+}
+
+// wait_for_workers waits until no worker can still be answering from a table
+// published before generation
+void wait_for_workers(struct udp_server* srv, unsigned long generation)
+{
+    struct timespec pause = { 0, 1000000 };
+    for (int i = 0; i < srv->num_workers; i++) {
+        unsigned long quiescent;
+        while ((quiescent = atomic_load(&srv->workers[i].quiescent)) != OFFLINE && quiescent < generation)
+            nanosleep(&pause, NULL);
+    }
+}
+
+// reload_server_data loads the table again and swaps it in for the current one,
+// which is freed once the workers are done with it. If loading fails, for
+// example because the file is in the middle of being replaced, the current table
+// stays in use.
+void reload_server_data(struct udp_server* srv)
+{
+    struct table* t = srv->loader();
+    if (t == NULL) {
+        fprintf(stderr, "%s: reload failed, keeping the current data\n", srv->name);
+        return;
+    }
+    struct table* old = atomic_exchange(&srv->table, t);
+    unsigned long generation = atomic_fetch_add(&srv->generation, 1) + 1;
+    wait_for_workers(srv, generation);
+    free_table(old);
+    log_notice("The %s reloaded its data: %u entries.\n", srv->name, t->num_keys);
+}
+
+// is_watched tells whether name is one of the files the server reloads on
+int is_watched(struct udp_server* srv, const char* name)
+{
+    for (int i = 0; i < 2; i++) {
+        if (srv->watched_files[i] != NULL && strcmp(srv->watched_files[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// watch_main is the loop of the watcher thread. It watches the current directory
+// rather than the files, because editors and the snapshot tool replace a file by
+// renaming a new one over it, which would end a watch on the file itself. Only
+// such a rename triggers a reload: the live table is served straight from the
+// mapped file, so a file rewritten in place is already unsafe to read, and
+// reloading from it would only put a second mapping of it live.
+void* watch_main(void* arg)
+{
+    struct udp_server* srv = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int fd;
+    ssize_t len;
+
+    if ((fd = inotify_init1(IN_CLOEXEC)) == -1
+            || inotify_add_watch(fd, ".", IN_MOVED_TO) == -1) {
+        perror("inotify");
+        return NULL;
+    }
+    while(1) {
+        if ((len = read(fd, buf, sizeof buf)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("inotify read");
+            return NULL;
+        }
+        // one reload covers every change read at once
+        int changed = 0;
+        struct inotify_event* event;
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event*)p;
+            if (event->len > 0 && is_watched(srv, event->name))
+                changed = 1;
+        }
+        if (changed)
+            reload_server_data(srv);
+    }
+    return NULL;
+}
+
+// metrics_main is the loop of the metrics thread: it dumps the metrics of the
+// workers every metrics_interval seconds, if set, and whenever SIGUSR1 arrives,
+// which every other thread blocks
+void* metrics_main(void* arg)
+{
+    struct udp_server* srv = arg;
+    struct timespec interval = { srv->metrics_interval, 0 };
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while(1) {
+        if (sigtimedwait(&set, NULL, srv->metrics_interval > 0 ? &interval : NULL) == -1 && errno != EAGAIN)
+            continue;
+        metrics_dump(&srv->metrics);
+    }
+    return NULL;
+}
+
+// worker_main is the loop of one worker thread
+void* worker_main(void* arg)
+{
+    struct worker* w = arg;
+    while(1) {
+        udp_recv_and_respond(w);
+    }
+    return NULL;
+}
+
+// run_udp_server starts the worker threads, the calling thread being the first
+// of them, the watcher thread and the metrics thread, and services requests forever
+void run_udp_server(struct udp_server* srv)
+{
+    struct worker* workers = calloc(srv->num_workers, sizeof(struct worker));
+    pthread_t thread;
+    sigset_t set;
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (metrics_init(&srv->metrics, srv->name, stage_names, NUM_STAGES, counter_names, NUM_COUNTERS, srv->num_workers) == -1)
+        exit(1);
+    for (int i = 0; i < srv->num_workers; i++) {
+        workers[i].srv = srv;
+        workers[i].sockfd = srv->sockfds[i];
+        workers[i].metrics = &srv->metrics.slots[i];
+        atomic_init(&workers[i].quiescent, OFFLINE);
+    }
+    srv->workers = workers;
+    // threads inherit the signal mask, so SIGUSR1 reaches only the metrics thread
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if ((errno = pthread_create(&thread, NULL, watch_main, srv)) != 0
+            || (errno = pthread_create(&thread, NULL, metrics_main, srv)) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    for (int i = 1; i < srv->num_workers; i++) {
+        if ((errno = pthread_create(&thread, NULL, worker_main, &workers[i])) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+}
@@ -0,0 +1,53 @@
+// udp_server.h declares the UDP request loop shared by the servers C/CS/EE
+#ifndef UDP_SERVER_H
+#define UDP_SERVER_H
+
+#include <stdatomic.h>
+
+#include "table.h"
+#include "metrics.h"
+
+#define MAXWORKERS 64
+#define UDP_MAXLEN 8192  // longest request or response string, batches included
+#define UDP_BATCH 32  // datagrams received or sent per recvmmsg/sendmmsg call
+#define UDP_RCVBUF (1 << 22)  // receive buffer of each worker socket, for a burst of
+                              // requests from serverM while the worker is busy
+
+// request_handler turns the string request of one datagram into the string
+// response, looking it up in t. It is called from several worker threads at
+// once, so it must only read shared data, and the response must outlive the
+// call: it is usually a view into t, sent from there without a copy, or a view
+// into request, which the handler may overwrite with its response. t stays
+// valid until the response has been sent, even if the data is reloaded meanwhile.
+typedef struct str_view (*request_handler)(const struct table* t, char request[]);
+
+// table_loader loads the data of a server, returning NULL on failure
+typedef struct table* (*table_loader)(void);
+
+struct worker;
+
+// udp_server is a group of worker threads, each with its own SO_REUSEPORT socket
+// bound to the same port, answering requests with the same handler. A watcher
+// thread reloads the table whenever one of the watched files changes, and
+// publishes the new table to the workers while they keep serving from the old one.
+struct udp_server {
+    const char* name;  // e.g. "ServerC", used in log lines
+    request_handler handler;
+    table_loader loader;
+    const char* watched_files[2];  // names in the current directory; NULL if unused
+    const char* port;
+    int num_workers;
+    int sockfds[MAXWORKERS];
+    struct worker* workers;
+    struct table* _Atomic table;  // the table requests are answered from
+    atomic_ulong generation;  // incremented each time a new table is published
+    struct metrics metrics;  // one slot per worker
+    int metrics_interval;  // seconds between metrics dumps; 0 dumps only on SIGUSR1
+};
+
+void parse_server_options(struct udp_server* srv, int argc, char* argv[]);
+int start_udp_server(struct udp_server* srv);
+int load_server_data(struct udp_server* srv);
+void run_udp_server(struct udp_server* srv);
+
+#endif